@@ -14,16 +14,103 @@
 
 // This file may be included from both the Linux and the Win32 code.
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define AGENT_MAX_MSGLEN 256 * 1024 // same as in openssh-portable
 
 #define WSLP_CHILD_FLAG_DEBUG (1 << 0)
 
+// Agent protocol message numbers (draft-miller-ssh-agent)
+#define SSH_AGENT_FAILURE                   5
+#define SSH_AGENT_SUCCESS                   6
+#define SSH_AGENTC_REQUEST_IDENTITIES       11
+#define SSH_AGENT_IDENTITIES_ANSWER         12
+#define SSH_AGENTC_SIGN_REQUEST             13
+#define SSH_AGENT_SIGN_RESPONSE             14
+#define SSH_AGENTC_ADD_IDENTITY             17
+#define SSH_AGENTC_REMOVE_IDENTITY          18
+#define SSH_AGENTC_REMOVE_ALL_IDENTITIES    19
+#define SSH_AGENTC_ADD_SMARTCARD_KEY        20
+#define SSH_AGENTC_REMOVE_SMARTCARD_KEY     21
+#define SSH_AGENTC_LOCK                     22
+#define SSH_AGENTC_UNLOCK                   23
+#define SSH_AGENTC_ADD_ID_CONSTRAINED       25
+#define SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED 26
+#define SSH_AGENTC_EXTENSION                27
+
+// Key constraints of SSH_AGENTC_ADD_ID_CONSTRAINED
+#define SSH_AGENT_CONSTRAIN_LIFETIME        1
+#define SSH_AGENT_CONSTRAIN_CONFIRM         2
+#define SSH_AGENT_CONSTRAIN_EXTENSION       255
+
+// Flags of SSH_AGENTC_SIGN_REQUEST
+#define SSH_AGENT_RSA_SHA2_256              2
+#define SSH_AGENT_RSA_SHA2_512              4
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    // Big-endian 32-bit values, which need not be aligned in a message.
+    static inline uint32_t get_u32(const void *p) {
+        const uint8_t *b = (const uint8_t *)p;
+        return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    }
+
+    static inline void put_u32(void *p, uint32_t v) {
+        uint8_t *b = (uint8_t *)p;
+        b[0] = (uint8_t)(v >> 24);
+        b[1] = (uint8_t)(v >> 16);
+        b[2] = (uint8_t)(v >> 8);
+        b[3] = (uint8_t)v;
+    }
+
+    // Size of the message at p, including its 4-byte length.
     static inline uint32_t msglen(const void *p) {
-        return 4 + ntohl(*(const uint32_t *)p);
+        return 4 + get_u32(p);
+    }
+
+    // Messages travel as frames: a 4-byte big-endian length, then that many
+    // bytes. frame_check() keeps no state of its own, so it can be called
+    // again each time more of a frame has been read into a buffer.
+#define FRAME_PARTIAL 0  // more input is needed
+#define FRAME_TOO_LONG (-1)  // the length is over the limit
+
+    // Look at the len bytes at buf, which start with a frame. Returns its size
+    // including the length once it is complete, FRAME_PARTIAL until then, or
+    // FRAME_TOO_LONG as soon as its length says it is larger than max bytes.
+    static inline int64_t frame_check(const void *buf, size_t len, size_t max) {
+        uint32_t body;
+
+        if (len < 4)
+            return FRAME_PARTIAL;
+        body = get_u32(buf);
+        if (max < 4 || body > max - 4)
+            return FRAME_TOO_LONG;
+        return len - 4 >= body ? (int64_t)body + 4 : FRAME_PARTIAL;
+    }
+
+    // Walks the frames in a buffer which fills up over several reads: start is
+    // where the next frame begins, end where the data read so far ends.
+    struct frame_reader {
+        size_t start, end;
+    };
+
+    // Returns the size of the next frame, frame_check() style. A complete frame
+    // is at buf + r->start, and is consumed: r->start moves past it.
+    static inline int64_t frame_next(struct frame_reader *r, const uint8_t *buf, size_t max) {
+        int64_t size = frame_check(buf + r->start, r->end - r->start, max);
+
+        if (size > 0)
+            r->start += (size_t)size;
+        return size;
+    }
+
+    // Start a frame with a body of len bytes at buf, returning its full size.
+    static inline size_t frame_put_header(void *buf, uint32_t len) {
+        put_u32(buf, len);
+        return (size_t)len + 4;
     }
 
 #ifdef __cplusplus
@@ -0,0 +1,442 @@
+/*
+ * ssh-agent-wsl load driver, to measure an agent under many clients.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// Runs clients against an agent socket, each a process of its own since the
+// agent tells peers apart by process, with one or more connections, and
+// prints the latency percentiles and throughput of their requests. With pipe-standin behind the agent, it makes
+// the measurements in the README reproducible.
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+
+#define MAX_CLIENTS 1024
+#define MAX_CONNS 256  // per client
+
+static struct {
+    const char *sock;
+    int clients;
+    int conns;  // per client
+    long requests;  // per connection
+    int sign;
+    size_t min_size, max_size;  // of the data to sign
+    int key;  // to sign with, from 1 in the listing
+    int connect_each;
+    int wait_ms;  // between connecting and sending, with connect_each
+    int think_ms;  // between requests
+} opt = { NULL, 1, 1, 1000, 0, 32, 32, 1, 0, 0, 0 };
+
+
+static double
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+static void
+sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+// A path, or @NAME for an abstract socket
+static int
+connect_agent()
+{
+    struct sockaddr_un addr;
+    size_t len = strlen(opt.sock);
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (len >= sizeof(addr.sun_path))
+        errx(1, "socket path %s is too long", opt.sock);
+    memcpy(addr.sun_path, opt.sock, len);
+    if (opt.sock[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        len += 1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        err(1, "socket");
+    if (connect(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+        warn("cannot connect to %s", opt.sock);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Send the request in buf and read the reply into it
+static int
+transact(int fd, uint8_t *buf)
+{
+    size_t len = msglen(buf), done;
+    int64_t size;
+    ssize_t n;
+
+    for (done = 0; done < len; done += (size_t)n) {
+        if ((n = write(fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    for (done = 0; (size = frame_check(buf, done, AGENT_MAX_MSGLEN)) == FRAME_PARTIAL; done += (size_t)n) {
+        if ((n = read(fd, buf + done, AGENT_MAX_MSGLEN - done)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return size > 0 && (size_t)size == done && done > 4 ? 0 : -1;
+}
+
+
+// Copy the blob of key opt.key from a listing, returning its length
+static uint32_t
+find_key(int fd, uint8_t *buf, uint8_t *blob)
+{
+    uint32_t nkeys, len, i;
+    size_t pos = 9, end;
+
+    put_u32(buf, 1);
+    buf[4] = SSH_AGENTC_REQUEST_IDENTITIES;
+    if (transact(fd, buf) != 0 || buf[4] != SSH_AGENT_IDENTITIES_ANSWER || msglen(buf) < 9)
+        errx(1, "cannot list the keys of %s", opt.sock);
+    end = msglen(buf);
+    nkeys = get_u32(buf + 5);
+    for (i = 1; i <= nkeys; ++i) {
+        if (pos + 4 > end || (len = get_u32(buf + pos)) > end - pos - 4)
+            break;
+        if (i == (uint32_t)opt.key) {
+            memcpy(blob, buf + pos + 4, len);
+            return len;
+        }
+        pos += 4 + len;
+        if (pos + 4 > end || get_u32(buf + pos) > end - pos - 4)
+            break;
+        pos += 4 + get_u32(buf + pos);  // the comment
+    }
+    errx(1, "%s lists no key %d to sign with", opt.sock, opt.key);
+}
+
+
+// Put the next request in buf
+static void
+make_request(uint8_t *buf, const uint8_t *blob, uint32_t blob_len, unsigned short *xsubi)
+{
+    size_t size = opt.min_size, pos = 5;
+
+    if (!opt.sign) {
+        put_u32(buf, 1);
+        buf[4] = SSH_AGENTC_REQUEST_IDENTITIES;
+        return;
+    }
+    if (opt.max_size > opt.min_size)
+        size += (size_t)nrand48(xsubi) % (opt.max_size - opt.min_size + 1);
+    buf[4] = SSH_AGENTC_SIGN_REQUEST;
+    put_u32(buf + pos, blob_len);
+    memcpy(buf + pos + 4, blob, blob_len);
+    pos += 4 + blob_len;
+    put_u32(buf + pos, (uint32_t)size);
+    memset(buf + pos + 4, 'x', size);
+    pos += 4 + size;
+    put_u32(buf + pos, 0);  // flags
+    pos += 4;
+    put_u32(buf, (uint32_t)(pos - 4));
+}
+
+
+// One connection of a client, with the latency of each request in ms, or -1
+// for a failure
+struct conn {
+    pthread_t thread;
+    int id;
+    double *latencies;
+};
+
+static pthread_barrier_t conns_ready, conns_start;
+
+
+static void *
+conn_main(void *arg)
+{
+    struct conn *c = arg;
+    uint8_t *buf = malloc(AGENT_MAX_MSGLEN), *blob = malloc(AGENT_MAX_MSGLEN);
+    unsigned short xsubi[3] = { 0x330e, (unsigned short)c->id, (unsigned short)getpid() };
+    uint8_t expect = opt.sign ? SSH_AGENT_SIGN_RESPONSE : SSH_AGENT_IDENTITIES_ANSWER;
+    uint32_t blob_len = 0;
+    int fd = -1;
+    long i;
+
+    if (!buf || !blob)
+        err(1, "malloc");
+    if (opt.sign) {
+        if ((fd = connect_agent()) < 0)
+            exit(1);
+        blob_len = find_key(fd, buf, blob);
+    }
+    if (!opt.connect_each && fd < 0 && (fd = connect_agent()) < 0)
+        exit(1);
+    if (opt.connect_each && fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    pthread_barrier_wait(&conns_ready);
+    pthread_barrier_wait(&conns_start);
+
+    for (i = 0; i < opt.requests; ++i) {
+        double started;
+
+        make_request(buf, blob, blob_len, xsubi);
+        started = now_ms();
+        if (opt.connect_each) {
+            fd = connect_agent();
+            if (fd >= 0 && opt.wait_ms > 0)
+                sleep_ms(opt.wait_ms);
+        }
+        if (fd >= 0 && transact(fd, buf) == 0 && buf[4] == expect)
+            c->latencies[i] = now_ms() - started;
+        else {
+            c->latencies[i] = -1;
+            // The connection may be out of step now
+            if (!opt.connect_each) {
+                if (fd >= 0)
+                    close(fd);
+                fd = connect_agent();
+            }
+        }
+        if (opt.connect_each && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (opt.think_ms > 0)
+            sleep_ms(opt.think_ms);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(blob);
+    return NULL;
+}
+
+
+// Run one client with opt.conns connections, each in a thread
+static void
+client_main(int id, int ready_fd, int start_fd, double *latencies)
+{
+    struct conn *conns = calloc((size_t)opt.conns, sizeof(*conns));
+    char go;
+    int i;
+
+    if (!conns)
+        err(1, "calloc");
+    pthread_barrier_init(&conns_ready, NULL, (unsigned)opt.conns + 1);
+    pthread_barrier_init(&conns_start, NULL, (unsigned)opt.conns + 1);
+    for (i = 0; i < opt.conns; ++i) {
+        conns[i].id = id * opt.conns + i;
+        conns[i].latencies = latencies + (size_t)i * (size_t)opt.requests;
+        if ((errno = pthread_create(&conns[i].thread, NULL, conn_main, &conns[i])) != 0)
+            err(1, "pthread_create");
+    }
+    // All clients start together, once they have connected and found their key
+    pthread_barrier_wait(&conns_ready);
+    if (write(ready_fd, "", 1) != 1 || read(start_fd, &go, 1) < 0)
+        err(1, "start");
+    pthread_barrier_wait(&conns_start);
+    for (i = 0; i < opt.conns; ++i)
+        pthread_join(conns[i].thread, NULL);
+    exit(0);
+}
+
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double
+percentile(const double *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p / 100 * (double)n);
+
+    return sorted[i < n ? i : n - 1];
+}
+
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s -a SOCKET [options]\n", prog);
+    printf("Options:\n");
+    printf("  -a SOCKET      Agent socket (@NAME for an abstract socket).\n");
+    printf("  -c N           Number of clients, each a process of its own (default: 1).\n");
+    printf("  -j N           Connections per client, each in a thread of its own (default: 1).\n");
+    printf("  -n N           Requests per connection (default: 1000).\n");
+    printf("  -t list|sign   Request to send (default: list).\n");
+    printf("  -s MIN[:MAX]   Bytes of data to sign, uniformly between MIN and MAX (default: 32).\n");
+    printf("  -k N           Sign with the Nth key the agent lists (default: 1).\n");
+    printf("  -C             Connect anew for each request, timed from connecting.\n");
+    printf("  -w MS          With -C, wait MS milliseconds between connecting and sending.\n");
+    printf("  -i MS          Wait MS milliseconds after each reply.\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static pid_t pids[MAX_CLIENTS];
+    int ready[2], start[2], c, i;
+    size_t total, n = 0, j;
+    long failed = 0;
+    double *latencies, *sorted, started, elapsed;
+    char *end;
+
+    while ((c = getopt(argc, argv, "a:c:j:n:t:s:k:Cw:i:h")) != -1) {
+        switch (c) {
+        case 'a':
+            opt.sock = optarg;
+            break;
+        case 'c':
+            opt.clients = atoi(optarg);
+            if (opt.clients < 1 || opt.clients > MAX_CLIENTS)
+                errx(1, "invalid -c %s, use 1 to %d", optarg, MAX_CLIENTS);
+            break;
+        case 'j':
+            opt.conns = atoi(optarg);
+            if (opt.conns < 1 || opt.conns > MAX_CONNS)
+                errx(1, "invalid -j %s, use 1 to %d", optarg, MAX_CONNS);
+            break;
+        case 'n':
+            if ((opt.requests = atol(optarg)) < 1)
+                errx(1, "invalid -n %s", optarg);
+            break;
+        case 't':
+            if (strcmp(optarg, "list") == 0)
+                opt.sign = 0;
+            else if (strcmp(optarg, "sign") == 0)
+                opt.sign = 1;
+            else
+                errx(1, "invalid -t %s, use list or sign", optarg);
+            break;
+        case 's':
+            opt.min_size = opt.max_size = strtoul(optarg, &end, 10);
+            if (*end == ':')
+                opt.max_size = strtoul(end + 1, &end, 10);
+            if (*end != '\0' || opt.max_size < opt.min_size || opt.max_size > AGENT_MAX_MSGLEN - 4096)
+                errx(1, "invalid -s %s", optarg);
+            break;
+        case 'k':
+            if ((opt.key = atoi(optarg)) < 1)
+                errx(1, "invalid -k %s", optarg);
+            break;
+        case 'C':
+            opt.connect_each = 1;
+            break;
+        case 'w':
+            opt.wait_ms = atoi(optarg);
+            break;
+        case 'i':
+            opt.think_ms = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!opt.sock || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    total = (size_t)opt.clients * (size_t)opt.conns * (size_t)opt.requests;
+    latencies = mmap(NULL, total * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (latencies == MAP_FAILED)
+        err(1, "mmap");
+    if (pipe(ready) < 0 || pipe(start) < 0)
+        err(1, "pipe");
+    for (i = 0; i < opt.clients; ++i) {
+        if ((pids[i] = fork()) < 0)
+            err(1, "fork");
+        if (pids[i] == 0) {
+            close(ready[0]);
+            close(start[1]);
+            client_main(i, ready[1], start[0], latencies + (size_t)i * (size_t)opt.conns * (size_t)opt.requests);
+        }
+    }
+    close(ready[1]);
+    close(start[0]);
+    // Once every client has connected and found its key
+    for (i = 0; i < opt.clients; ++i) {
+        char ok;
+
+        if (read(ready[0], &ok, 1) != 1)
+            errx(1, "a client failed to start");
+    }
+    started = now_ms();
+    close(start[1]);
+    for (i = 0; i < opt.clients; ++i) {
+        int status;
+
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errx(1, "client %d failed", i);
+    }
+    elapsed = now_ms() - started;
+
+    if ((sorted = malloc(total * sizeof(double))) == NULL)
+        err(1, "malloc");
+    for (j = 0; j < total; ++j) {
+        if (latencies[j] < 0)
+            ++failed;
+        else
+            sorted[n++] = latencies[j];
+    }
+    printf("%zu requests in %.2f s: %.0f/s, %ld failed\n", n + (size_t)failed, elapsed / 1000,
+           n * 1000 / elapsed, failed);
+    if (n > 0) {
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        printf("latency ms: p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+               percentile(sorted, n, 50), percentile(sorted, n, 95), percentile(sorted, n, 99), sorted[n - 1]);
+    }
+    free(sorted);
+    return 0;
+}
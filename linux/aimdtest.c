@@ -0,0 +1,222 @@
+/*
+ * ssh-agent-wsl test of the adaptive connection limit of pipe-connector.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// win32/aimd.c has no Windows dependencies, so it is tested here: first step
+// by step, then with threads queueing for a simulated agent which only has a
+// few pipe instances, the way agent_query() does.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "aimd.h"
+
+static int failures = 0;
+
+#define check(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+
+static void
+test_steps()
+{
+    struct aimd a;
+    uint32_t t0, t1, t2;
+
+    aimd_init(&a, 2, 8);
+    t0 = aimd_enqueue(&a);
+    t1 = aimd_enqueue(&a);
+    t2 = aimd_enqueue(&a);
+
+    // In order of arrival, up to the limit
+    check(!aimd_start(&a, t1));
+    check(aimd_start(&a, t0));
+    check(aimd_start(&a, t1));
+    check(aimd_turn(&a, t2));
+    check(!aimd_start(&a, t2));
+
+    // A busy pipe halves the limit and asks for a backoff
+    aimd_done(&a, AIMD_BUSY, 0, 0);
+    check(a.limit == 1);
+    check(aimd_backoff_ms(&a) > 0);
+
+    // Which is waited out without holding a connection, and the request
+    // which retries keeps its place ahead of t2
+    aimd_retry(&a);
+    check(a.inflight == 1);
+    check(aimd_turn(&a, t0));
+    check(!aimd_turn(&a, t2));
+    check(!aimd_start(&a, t0));  // t1 holds the one connection allowed
+    aimd_done(&a, AIMD_OK, 5, 1);
+    check(aimd_start(&a, t0));
+    check(aimd_turn(&a, t2));
+    aimd_done(&a, AIMD_OK, 5, 2);
+    check(aimd_backoff_ms(&a) == 0);
+    check(aimd_start(&a, t2));
+    aimd_done(&a, AIMD_OK, 5, 3);
+    check(a.inflight == 0);
+    check(a.limit > 1);
+
+    // Ticket numbers wrap around
+    aimd_init(&a, 1, 8);
+    a.next_ticket = a.head = UINT32_MAX;
+    t0 = aimd_enqueue(&a);
+    t1 = aimd_enqueue(&a);
+    check(aimd_start(&a, t0));
+    check(!aimd_start(&a, t1));
+    aimd_done(&a, AIMD_BUSY, 0, 0);
+    aimd_retry(&a);
+    check(aimd_turn(&a, t0));
+    check(!aimd_turn(&a, t1));
+    check(aimd_start(&a, t0));
+    aimd_done(&a, AIMD_OK, 5, 1);
+    check(aimd_start(&a, t1));
+}
+
+
+// The simulated agent
+#define SIM_THREADS 16
+#define SIM_REQUESTS 100  // per thread
+#define SIM_PIPES 3
+#define SIM_SERVICE_US 1000
+#define SIM_MAX_CONNECTIONS 8
+#define SIM_BUSY_TIMEOUT_MS 10000
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_changed = PTHREAD_COND_INITIALIZER;
+static struct aimd sim;
+static int sim_open = 0, sim_peak = 0;
+static long sim_ok = 0, sim_busy = 0, sim_failed = 0;
+
+
+static double
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+// As agent_query() does, with CreateFile() failing with ERROR_PIPE_BUSY while
+// all pipe instances are open
+static int
+sim_query()
+{
+    double started, busy_since = -1;
+    uint32_t ticket;
+    int backoff;
+
+    pthread_mutex_lock(&sim_lock);
+    ticket = aimd_enqueue(&sim);
+    while (1) {
+        while (!aimd_turn(&sim, ticket))
+            pthread_cond_wait(&sim_changed, &sim_lock);
+        if ((backoff = aimd_backoff_ms(&sim)) > 0) {
+            pthread_mutex_unlock(&sim_lock);
+            usleep(backoff * 1000);
+            pthread_mutex_lock(&sim_lock);
+        }
+        while (!aimd_start(&sim, ticket))
+            pthread_cond_wait(&sim_changed, &sim_lock);
+        pthread_cond_broadcast(&sim_changed);
+
+        started = now_ms();
+        if (sim_open < SIM_PIPES) {
+            if (++sim_open > sim_peak)
+                sim_peak = sim_open;
+            break;
+        }
+        ++sim_busy;
+        aimd_done(&sim, AIMD_BUSY, 0, (int64_t)started);
+        pthread_cond_broadcast(&sim_changed);
+        if (busy_since < 0)
+            busy_since = started;
+        else if (started - busy_since >= SIM_BUSY_TIMEOUT_MS) {
+            pthread_mutex_unlock(&sim_lock);
+            return -1;
+        }
+        aimd_retry(&sim);
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    usleep(SIM_SERVICE_US);
+
+    pthread_mutex_lock(&sim_lock);
+    --sim_open;
+    aimd_done(&sim, AIMD_OK, now_ms() - started, (int64_t)now_ms());
+    pthread_cond_broadcast(&sim_changed);
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+
+static void *
+sim_thread(void *arg)
+{
+    int i;
+
+    (void)arg;
+    for (i = 0; i < SIM_REQUESTS; ++i) {
+        int rc = sim_query();
+
+        pthread_mutex_lock(&sim_lock);
+        if (rc == 0)
+            ++sim_ok;
+        else
+            ++sim_failed;
+        pthread_mutex_unlock(&sim_lock);
+    }
+    return NULL;
+}
+
+
+static void
+test_simulation()
+{
+    pthread_t threads[SIM_THREADS];
+    double started = now_ms();
+    int i;
+
+    aimd_init(&sim, SIM_MAX_CONNECTIONS / 2, SIM_MAX_CONNECTIONS);
+    for (i = 0; i < SIM_THREADS; ++i)
+        pthread_create(&threads[i], NULL, sim_thread, NULL);
+    for (i = 0; i < SIM_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    printf("%d threads, %d pipes: %ld answered, %ld failed, %ld busy pipes (%.1f%%), "
+           "%.0f requests/s, limit %.1f\n",
+           SIM_THREADS, SIM_PIPES, sim_ok, sim_failed, sim_busy,
+           100.0 * sim_busy / (sim_busy + sim_ok), sim_ok * 1000 / (now_ms() - started), sim.limit);
+    check(sim_ok == SIM_THREADS * SIM_REQUESTS);
+    check(sim_failed == 0);
+    check(sim_peak <= SIM_PIPES);
+    check(sim.inflight == 0 && sim.retrying == 0);
+    // The limit settles near the number of pipes rather than hitting them
+    // busy on every other attempt
+    check(sim_busy < sim_ok / 4);
+}
+
+
+int
+main()
+{
+    test_steps();
+    test_simulation();
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
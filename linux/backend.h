@@ -0,0 +1,61 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl backends, which answer the requests the daemon passes on.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Most requests a backend is given at once
+#define BACKEND_MAX_BATCH 16
+
+// Most backends the daemon can merge
+#define MAX_BACKENDS 4
+
+// A backend answers requests in two steps, so that it can work on several at
+// once: submit() passes n requests on, and complete() waits for the replies
+// and puts each in the buffer of its request. Both return 0, or -1 if the
+// backend failed, in which case none of the n requests gets a reply. Each
+// thread has state of its own in every backend. A backend with state of its
+// own embeds the struct and finds itself back from the pointer.
+struct backend {
+    const char *name;
+    int (*submit)(struct backend *b, uint8_t *const *bufs, int n);
+    int (*complete)(struct backend *b, uint8_t *const *bufs, int n);
+
+    // Get ready for a request which is likely to come soon (--prewarm).
+    void (*start)(struct backend *b);
+
+    // Let go of what has not been used for idle_ms milliseconds (--helper-idle).
+    void (*release_idle)(struct backend *b, int64_t idle_ms);
+
+    // Whether the backend could be reached the last time it was tried.
+    int (*healthy)(struct backend *b);
+};
+
+// Forward to an ssh-agent listening on a Unix socket, over persistent
+// connections: one per request of a batch, kept open for the next one.
+// Returns NULL with a warning if there are too many.
+struct backend *upstream_new(const char *name, const struct sockaddr_un *addr, socklen_t len);
+
+// Hedge slow requests to upstream agents (--hedge): when the reply to a
+// listing takes longer than 95% of the recent ones, the request is sent again
+// over another connection and the first reply is taken. HEDGE_SIGN also
+// hedges signing. Counts of hedged requests and of those which the second
+// copy won are kept for the stats.
+#define HEDGE_READ 1
+#define HEDGE_SIGN 2
+
+void upstream_set_hedging(int mode);
+void upstream_hedge_stats(unsigned long *sent, unsigned long *won);
+
+// Have spawn(name) start the agent of an upstream backend when nothing listens
+// on its socket, and return 0 once it does.
+void upstream_set_spawn(struct backend *b, int (*spawn)(const char *name));
@@ -0,0 +1,122 @@
+/*
+ * ssh-agent-wsl microbenchmark of the frame parser of common.h.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// Frames per second of frame_next() over a buffer full of frames of one
+// size, as the Win32 helper walks a batch, and of frame_check() re-run after
+// every read of READ_SIZE bytes, as the agent does on a socket. Usage:
+// framebench [SECONDS per case, default 1]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../common.h"
+
+#define READ_SIZE 4096
+
+static const uint32_t sizes[] = { 5, 64, 512, 4096, 65536, AGENT_MAX_MSGLEN };
+
+static uint8_t buf[AGENT_MAX_MSGLEN];
+
+static volatile size_t sink;  // keeps the loops from being optimized away
+
+
+static double
+now_s()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Fill buf with frames of size bytes each, returning how many fit
+static size_t
+fill(uint32_t size)
+{
+    size_t n = 0, pos;
+
+    memset(buf, 0xa5, sizeof(buf));
+    for (pos = 0; pos + size <= sizeof(buf); pos += size, ++n)
+        frame_put_header(buf + pos, size - 4);
+    return n;
+}
+
+
+static double
+bench_walk(size_t nframes, size_t len, double seconds)
+{
+    double started = now_s(), elapsed;
+    uint64_t frames = 0;
+
+    do {
+        int i;
+
+        for (i = 0; i < 64; ++i) {
+            struct frame_reader r = { 0, len };
+            size_t total = 0;
+            int64_t size;
+
+            while ((size = frame_next(&r, buf, AGENT_MAX_MSGLEN)) > 0)
+                total += (size_t)size;
+            sink = total;
+            frames += nframes;
+        }
+    } while ((elapsed = now_s() - started) < seconds);
+    return frames / elapsed;
+}
+
+
+static double
+bench_reads(size_t nframes, size_t len, double seconds)
+{
+    double started = now_s(), elapsed;
+    uint64_t frames = 0;
+
+    do {
+        int i;
+
+        for (i = 0; i < 64; ++i) {
+            size_t start = 0, end = 0, total = 0;
+            int64_t size;
+
+            while (start < len) {
+                // Read more only when the frame needs it, as the agent does
+                if ((size = frame_check(buf + start, end - start, AGENT_MAX_MSGLEN)) > 0) {
+                    total += (size_t)size;
+                    start += (size_t)size;
+                    continue;
+                }
+                end = end + READ_SIZE < len ? end + READ_SIZE : len;
+            }
+            sink = total;
+            frames += nframes;
+        }
+    } while ((elapsed = now_s() - started) < seconds);
+    return frames / elapsed;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+    size_t i;
+
+    printf("%10s %16s %16s\n", "frame", "walk frames/s", "reads frames/s");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        size_t nframes = fill(sizes[i]);
+        double walk = bench_walk(nframes, nframes * sizes[i], seconds);
+        double reads = bench_reads(nframes, nframes * sizes[i], seconds);
+
+        printf("%10u %16.0f %16.0f\n", sizes[i], walk, reads);
+    }
+    return 0;
+}
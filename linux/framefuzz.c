@@ -0,0 +1,212 @@
+/*
+ * ssh-agent-wsl fuzz harness for the frame parser of common.h.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// The first byte of an input picks the size limit, the second seeds how the
+// rest, a stream of frames, is split into reads. The stream is walked once
+// with frame_check() and once with frame_next() fed read by read, and both
+// must agree with what the bytes say. The stream is copied to a buffer of
+// its exact size, so that a sanitizer catches reads past the end.
+//
+// With cmake -DFRAMEFUZZ_LIBFUZZER=ON and Clang, it is built for libFuzzer.
+// Otherwise it runs the files given, or stdin, or with -n N that many random
+// inputs (ctest does).
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../common.h"
+
+#define MAX_FRAMES 4096
+
+static const size_t limits[8] = { 0, 3, 4, 5, 9, 64, 4096, AGENT_MAX_MSGLEN };
+
+static uint8_t window[AGENT_MAX_MSGLEN];  // the read buffer of frame_next()
+
+#define check(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+
+// What frame_check() must say of len bytes at buf
+static int64_t
+expected(const uint8_t *buf, size_t len, size_t max)
+{
+    uint64_t size;
+
+    if (len < 4)
+        return FRAME_PARTIAL;
+    size = (uint64_t)get_u32(buf) + 4;
+    if (size > max)
+        return FRAME_TOO_LONG;
+    return size <= len ? (int64_t)size : FRAME_PARTIAL;
+}
+
+
+static uint32_t
+next_random(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 16;
+}
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static int64_t frames[MAX_FRAMES + 1];
+    struct frame_reader r = { 0, 0 };
+    const uint8_t *stream;
+    uint8_t *buf;
+    size_t len, max, pos, fed, prefix;
+    uint32_t seed;
+    int nframes = 0, i = 0;
+    int64_t got;
+
+    if (size < 2)
+        return 0;
+    max = limits[data[0] & 7];
+    seed = data[1];
+    len = size - 2;
+    if ((buf = malloc(len ? len : 1)) == NULL)
+        err(1, "malloc");
+    memcpy(buf, data + 2, len);
+    stream = buf;
+
+    // All at once, and every shorter prefix of each frame is partial
+    for (pos = 0; nframes < MAX_FRAMES; ) {
+        got = frame_check(stream + pos, len - pos, max);
+        check(got == expected(stream + pos, len - pos, max));
+        frames[nframes++] = got;
+        if (got <= 0)
+            break;
+        check(got >= 4 && (size_t)got <= max && (size_t)got <= len - pos);
+        for (prefix = 0; prefix < (size_t)got; prefix += prefix < 64 ? 1 : prefix / 2)
+            check(frame_check(stream + pos, prefix, max) == FRAME_PARTIAL);
+        pos += (size_t)got;
+    }
+
+    // In reads of random sizes into the window, moving a partial frame to
+    // the start of it as the agent does
+    for (fed = 0; i < nframes; ) {
+        size_t room = sizeof(window) - r.end, n = len - fed;
+
+        if (n > room)
+            n = room;
+        if (n > 0 && (seed & 1))
+            n = 1 + next_random(&seed) % n;
+        memcpy(window + r.end, stream + fed, n);
+        r.end += n;
+        fed += n;
+
+        while (i < nframes) {
+            size_t start = r.start;
+
+            got = frame_next(&r, window, max);
+            check(got == frames[i] || (got == FRAME_PARTIAL && fed < len));
+            if (got <= 0)
+                break;
+            check(r.start == start + (size_t)got && r.start <= r.end);
+            ++i;
+        }
+        if (got == FRAME_TOO_LONG || fed == len || i == nframes)
+            break;
+        memmove(window, window + r.start, r.end - r.start);
+        r.end -= r.start;
+        r.start = 0;
+    }
+    check(i == nframes - 1 || (i == nframes && frames[i - 1] > 0));
+    free(buf);
+    return 0;
+}
+
+
+#ifndef FRAMEFUZZ_LIBFUZZER
+
+static void
+run_file(FILE *f, const char *name)
+{
+    static uint8_t input[2 + AGENT_MAX_MSGLEN * 2];
+    size_t n = fread(input, 1, sizeof(input), f);
+
+    if (ferror(f))
+        err(1, "%s", name);
+    LLVMFuzzerTestOneInput(input, n);
+}
+
+
+// Mostly well-formed streams, with lengths near the limits and some garbage
+static size_t
+random_input(uint8_t *input, size_t size, uint32_t *state)
+{
+    size_t len = 2, max;
+
+    input[0] = (uint8_t)next_random(state);
+    input[1] = (uint8_t)next_random(state);
+    max = limits[input[0] & 7];
+    while (len + 4 < size && next_random(state) % 8) {
+        uint32_t body, choice = next_random(state) % 16;
+
+        if (choice < 8)
+            body = next_random(state) % 32;
+        else if (choice < 12)
+            body = (uint32_t)(max > 4 ? max - 4 : 0) - 1 + next_random(state) % 3;
+        else if (choice < 14)
+            body = next_random(state) * 65536 + next_random(state);
+        else
+            body = (uint32_t)next_random(state) % 8192;
+        put_u32(input + len, body);
+        len += 4;
+        if (next_random(state) % 16 == 0)
+            len -= next_random(state) % 4;  // a length cut short
+        else if (body <= size - len)
+            len += body;  // the body itself is left as it was
+        else
+            break;
+    }
+    return len;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+
+    if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+        static uint8_t input[2 + 3 * 4096];
+        uint32_t state = (uint32_t)getpid();
+        long runs = atol(argv[2]);
+
+        for (i = 0; i < runs; ++i)
+            LLVMFuzzerTestOneInput(input, random_input(input, sizeof(input), &state));
+        printf("%ld random inputs\n", runs);
+        return 0;
+    }
+    if (argc == 1) {
+        run_file(stdin, "stdin");
+        return 0;
+    }
+    for (i = 1; i < argc; ++i) {
+        FILE *f = fopen(argv[i], "rb");
+
+        if (!f)
+            err(1, "%s", argv[i]);
+        run_file(f, argv[i]);
+        fclose(f);
+    }
+    return 0;
+}
+
+#endif
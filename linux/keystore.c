@@ -0,0 +1,821 @@
+/*
+ * ssh-agent-wsl in-process key store.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/param_build.h>
+
+#include "../common.h"
+#include "keystore.h"
+#include "timerwheel.h"
+
+// Large enough for the blob and the signature of a 16384-bit RSA key
+#define MAX_BLOB 4096
+
+// Secure heap for private keys, in bytes
+#define SECURE_HEAP_SIZE (256 * 1024)
+
+enum key_kind { KEY_ED25519, KEY_ECDSA, KEY_RSA };
+
+struct key_type {
+    const char *name;
+    enum key_kind kind;
+    int fields;  // strings and mpints of the private key after the name
+    const char *group;  // ECDSA: OpenSSL group name
+    const char *curve;  // ECDSA: SSH curve name
+};
+
+static const struct key_type key_types[] = {
+    { "ssh-ed25519", KEY_ED25519, 2, NULL, NULL },
+    { "ecdsa-sha2-nistp256", KEY_ECDSA, 3, "prime256v1", "nistp256" },
+    { "ecdsa-sha2-nistp384", KEY_ECDSA, 3, "secp384r1", "nistp384" },
+    { "ecdsa-sha2-nistp521", KEY_ECDSA, 3, "secp521r1", "nistp521" },
+    { "ssh-rsa", KEY_RSA, 6, NULL, NULL },
+};
+
+struct local_key {
+    struct local_key *next;
+    const struct key_type *type;
+    EVP_PKEY *pkey;
+    uint8_t *blob;
+    uint32_t blob_len;
+    uint8_t *comment;
+    uint32_t comment_len;
+    time_t expires;  // monotonic, 0 for never
+    struct timer lifetime_timer;  // pending until expires, in key_timers
+};
+
+// Reading a message: once past the end, err is set and nothing more is read
+struct reader {
+    const uint8_t *p;
+    size_t len;
+    int err;
+};
+
+// Writing one: err is set instead of going past cap
+struct writer {
+    uint8_t *p;
+    size_t len, cap;
+    int err;
+};
+
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct local_key *keys = NULL;
+
+// Keys with a lifetime are removed when it runs out by a thread of their own,
+// which ticks once a second while there are any. Requests catch up with the
+// wheel first, so they never see a key past its time.
+static struct timer_wheel key_timers;  // in seconds, under keys_lock
+static pthread_cond_t key_timers_armed;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+static int reaper_running = 0;
+static int store_mode = 0;
+static uint32_t store_lifetime = 0;
+static int store_locked = 0;
+static uint8_t lock_hash[32];  // of the passphrase while locked
+
+
+static time_t
+monotonic_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+static const uint8_t *
+read_string(struct reader *r, uint32_t *len)
+{
+    const uint8_t *data;
+
+    if (r->err || r->len < 4 || r->len - 4 < get_u32(r->p)) {
+        r->err = 1;
+        *len = 0;
+        return NULL;
+    }
+    *len = get_u32(r->p);
+    data = r->p + 4;
+    r->p += 4 + *len;
+    r->len -= 4 + *len;
+    return data;
+}
+
+
+static uint32_t
+read_u32(struct reader *r)
+{
+    uint32_t v;
+
+    if (r->err || r->len < 4) {
+        r->err = 1;
+        return 0;
+    }
+    v = get_u32(r->p);
+    r->p += 4;
+    r->len -= 4;
+    return v;
+}
+
+
+static int
+read_byte(struct reader *r)
+{
+    if (r->err || r->len < 1) {
+        r->err = 1;
+        return -1;
+    }
+    r->len--;
+    return *r->p++;
+}
+
+
+// An mpint of a key, which is never negative. Private parts go to the
+// secure heap.
+static BIGNUM *
+read_bn(struct reader *r, int secure)
+{
+    uint32_t len;
+    const uint8_t *data = read_string(r, &len);
+    BIGNUM *bn;
+
+    if (!data || (bn = secure ? BN_secure_new() : BN_new()) == NULL)
+        return NULL;
+    if (BN_bin2bn(data, (int)len, bn) == NULL) {
+        BN_clear_free(bn);
+        return NULL;
+    }
+    return bn;
+}
+
+
+static void
+write_u32(struct writer *w, uint32_t v)
+{
+    if (w->err || w->cap - w->len < 4) {
+        w->err = 1;
+        return;
+    }
+    put_u32(w->p + w->len, v);
+    w->len += 4;
+}
+
+
+static void
+write_byte(struct writer *w, uint8_t v)
+{
+    if (w->err || w->cap == w->len) {
+        w->err = 1;
+        return;
+    }
+    w->p[w->len++] = v;
+}
+
+
+static void
+write_string(struct writer *w, const void *data, size_t len)
+{
+    write_u32(w, (uint32_t)len);
+    if (w->err || w->cap - w->len < len) {
+        w->err = 1;
+        return;
+    }
+    memcpy(w->p + w->len, data, len);
+    w->len += len;
+}
+
+
+static void
+write_cstring(struct writer *w, const char *s)
+{
+    write_string(w, s, strlen(s));
+}
+
+
+static void
+write_bn(struct writer *w, const BIGNUM *bn)
+{
+    size_t len = (size_t)BN_num_bytes(bn);
+    int pad = len > 0 && BN_is_bit_set(bn, (int)len * 8 - 1);  // keep it positive
+
+    write_u32(w, (uint32_t)(len + pad));
+    if (pad)
+        write_byte(w, 0);
+    if (w->err || w->cap - w->len < len) {
+        w->err = 1;
+        return;
+    }
+    BN_bn2bin(bn, w->p + w->len);
+    w->len += len;
+}
+
+
+static const struct key_type *
+find_key_type(const uint8_t *name, uint32_t len)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(key_types) / sizeof(key_types[0]); ++i) {
+        if (strlen(key_types[i].name) == len && memcmp(key_types[i].name, name, len) == 0)
+            return &key_types[i];
+    }
+    return NULL;
+}
+
+
+// Read the constraints at the end of an add request. Returns the lifetime,
+// 0 for none, or -1 if there is one the store can't enforce: confirmation
+// needs a prompt, and extensions are not known.
+static int64_t
+read_constraints(struct reader *r)
+{
+    int64_t lifetime = 0;
+
+    while (r->len > 0 && !r->err) {
+        switch (read_byte(r)) {
+        case SSH_AGENT_CONSTRAIN_LIFETIME:
+            lifetime = read_u32(r);
+            break;
+        default:
+            return -1;
+        }
+    }
+    return r->err ? -1 : lifetime;
+}
+
+
+int
+keystore_accepts(const uint8_t *msg)
+{
+    struct reader r = { msg + 5, msglen(msg) - 5, 0 };
+    const struct key_type *type;
+    const uint8_t *name;
+    uint32_t len;
+    int64_t lifetime;
+    int i;
+
+    if (!store_mode || msglen(msg) < 5 ||
+        (msg[4] != SSH_AGENTC_ADD_IDENTITY && msg[4] != SSH_AGENTC_ADD_ID_CONSTRAINED))
+        return 0;
+    if ((name = read_string(&r, &len)) == NULL || (type = find_key_type(name, len)) == NULL)
+        return 0;
+    for (i = 0; i < type->fields + 1; ++i)  // and the comment
+        read_string(&r, &len);
+    if ((lifetime = read_constraints(&r)) < 0)
+        return 0;
+    return store_mode == KEYSTORE_ALL || lifetime > 0;
+}
+
+
+static EVP_PKEY *
+pkey_fromdata(const char *algorithm, OSSL_PARAM_BLD *bld)
+{
+    OSSL_PARAM *params = OSSL_PARAM_BLD_to_param(bld);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, algorithm, NULL);
+    EVP_PKEY *pkey = NULL;
+
+    if (!params || !ctx || EVP_PKEY_fromdata_init(ctx) <= 0 ||
+        EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_KEYPAIR, params) <= 0)
+        pkey = NULL;
+    EVP_PKEY_CTX_free(ctx);
+    OSSL_PARAM_free(params);  // clears the secure part, with the private numbers
+
+    // A public half which does not match would list one key and sign with
+    // another
+    if (pkey && ((ctx = EVP_PKEY_CTX_new_from_pkey(NULL, pkey, NULL)) == NULL ||
+                 EVP_PKEY_pairwise_check(ctx) != 1)) {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+
+static EVP_PKEY *
+read_ecdsa_key(struct reader *r, const struct key_type *type, struct writer *blob)
+{
+    OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+    const uint8_t *curve, *q;
+    uint32_t curve_len, q_len;
+    BIGNUM *d;
+    EVP_PKEY *pkey = NULL;
+
+    curve = read_string(r, &curve_len);
+    q = read_string(r, &q_len);
+    d = read_bn(r, 1);
+    if (bld && d && curve_len == strlen(type->curve) && memcmp(curve, type->curve, curve_len) == 0 &&
+        OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME, type->group, 0) &&
+        OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY, q, q_len) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY, d))
+        pkey = pkey_fromdata("EC", bld);
+    write_cstring(blob, type->name);
+    write_string(blob, curve, curve_len);
+    write_string(blob, q, q_len);
+    BN_clear_free(d);
+    OSSL_PARAM_BLD_free(bld);
+    return pkey;
+}
+
+
+static EVP_PKEY *
+read_rsa_key(struct reader *r, const struct key_type *type, struct writer *blob)
+{
+    OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+    BN_CTX *ctx = BN_CTX_secure_new();
+    BIGNUM *n = read_bn(r, 0), *e = read_bn(r, 0);
+    BIGNUM *d = read_bn(r, 1), *iqmp = read_bn(r, 1), *p = read_bn(r, 1), *q = read_bn(r, 1);
+    BIGNUM *dmp1 = BN_secure_new(), *dmq1 = BN_secure_new(), *tmp = BN_secure_new();
+    EVP_PKEY *pkey = NULL;
+
+    // OpenSSH leaves out the CRT exponents, which OpenSSL wants
+    if (bld && ctx && n && e && d && iqmp && p && q && dmp1 && dmq1 && tmp &&
+        BN_sub(tmp, p, BN_value_one()) && BN_mod(dmp1, d, tmp, ctx) &&
+        BN_sub(tmp, q, BN_value_one()) && BN_mod(dmq1, d, tmp, ctx) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_D, d) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_FACTOR1, p) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_FACTOR2, q) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_EXPONENT1, dmp1) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_EXPONENT2, dmq1) &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_COEFFICIENT1, iqmp))
+        pkey = pkey_fromdata("RSA", bld);
+    if (n && e) {
+        write_cstring(blob, type->name);
+        write_bn(blob, e);
+        write_bn(blob, n);
+    }
+    BN_free(n);
+    BN_free(e);
+    BN_clear_free(d);
+    BN_clear_free(iqmp);
+    BN_clear_free(p);
+    BN_clear_free(q);
+    BN_clear_free(dmp1);
+    BN_clear_free(dmq1);
+    BN_clear_free(tmp);
+    BN_CTX_free(ctx);
+    OSSL_PARAM_BLD_free(bld);
+    return pkey;
+}
+
+
+static EVP_PKEY *
+read_ed25519_key(struct reader *r, const struct key_type *type, struct writer *blob)
+{
+    const uint8_t *pk, *sk;
+    uint8_t derived[32];
+    uint32_t pk_len, sk_len;
+    size_t derived_len = sizeof(derived);
+    EVP_PKEY *pkey;
+
+    pk = read_string(r, &pk_len);
+    sk = read_string(r, &sk_len);  // the seed, then the public key again
+    if (!pk || !sk || pk_len != 32 || sk_len != 64)
+        return NULL;
+    write_cstring(blob, type->name);
+    write_string(blob, pk, pk_len);
+    // Both copies of the public key must be the one of the seed
+    if ((pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, sk, 32)) != NULL &&
+        (EVP_PKEY_get_raw_public_key(pkey, derived, &derived_len) != 1 || derived_len != 32 ||
+         memcmp(derived, pk, 32) != 0 || memcmp(sk + 32, pk, 32) != 0)) {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    return pkey;
+}
+
+
+static void
+key_free(struct local_key *k)
+{
+    timer_del(&key_timers, &k->lifetime_timer);
+    EVP_PKEY_free(k->pkey);
+    free(k->blob);
+    free(k->comment);
+    free(k);
+}
+
+
+static struct local_key **
+find_key(const uint8_t *blob, uint32_t len)
+{
+    struct local_key **kp;
+
+    for (kp = &keys; *kp; kp = &(*kp)->next) {
+        if ((*kp)->blob_len == len && memcmp((*kp)->blob, blob, len) == 0)
+            break;
+    }
+    return kp;
+}
+
+
+static void
+key_expired(struct timer *t, void *arg)
+{
+    struct local_key *k = (struct local_key *)((char *)t - offsetof(struct local_key, lifetime_timer));
+    struct local_key **kp;
+
+    (void)arg;
+    // Lifetimes beyond the reach of the wheel come back early
+    if (key_timers.now < k->expires) {
+        timer_add(&key_timers, t, k->expires);
+        return;
+    }
+    for (kp = &keys; *kp != k; kp = &(*kp)->next)
+        ;
+    *kp = k->next;
+    key_free(k);
+}
+
+
+// Remove the keys whose lifetime has run out, with keys_lock held
+static void
+remove_expired()
+{
+    timer_wheel_advance(&key_timers, monotonic_secs(), key_expired, NULL);
+}
+
+
+static void *
+reaper_main(void *arg)
+{
+    struct timespec next;
+
+    (void)arg;
+    pthread_mutex_lock(&keys_lock);
+    while (1) {
+        if (key_timers.count == 0) {
+            pthread_cond_wait(&key_timers_armed, &keys_lock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += 1;
+        next.tv_nsec = 0;
+        pthread_cond_timedwait(&key_timers_armed, &keys_lock, &next);
+        remove_expired();
+    }
+    return NULL;
+}
+
+
+static void
+start_reaper()
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&key_timers_armed, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread, NULL, reaper_main, NULL) != 0) {
+        warnx("could not start a thread to remove expired local keys, they go on the next request");
+        return;
+    }
+    pthread_detach(thread);
+    reaper_running = 1;
+}
+
+
+static int
+add_key(struct reader *r)
+{
+    uint8_t blob_buf[MAX_BLOB];
+    struct writer blob = { blob_buf, 0, sizeof(blob_buf), 0 };
+    struct local_key *k, **old;
+    const struct key_type *type;
+    const uint8_t *name, *comment;
+    uint32_t len, comment_len;
+    int64_t lifetime;
+
+    if ((name = read_string(r, &len)) == NULL || (type = find_key_type(name, len)) == NULL ||
+        (k = calloc(1, sizeof(*k))) == NULL)
+        return -1;
+    k->type = type;
+    switch (type->kind) {
+    case KEY_ED25519:
+        k->pkey = read_ed25519_key(r, type, &blob);
+        break;
+    case KEY_ECDSA:
+        k->pkey = read_ecdsa_key(r, type, &blob);
+        break;
+    case KEY_RSA:
+        k->pkey = read_rsa_key(r, type, &blob);
+        break;
+    }
+    comment = read_string(r, &comment_len);
+    lifetime = read_constraints(r);
+    if (!k->pkey || blob.err || !comment || lifetime < 0 ||
+        (k->blob = malloc(blob.len)) == NULL || (k->comment = malloc(comment_len + 1)) == NULL) {
+        key_free(k);
+        return -1;
+    }
+    memcpy(k->blob, blob.p, blob.len);
+    k->blob_len = (uint32_t)blob.len;
+    memcpy(k->comment, comment, comment_len);
+    k->comment_len = comment_len;
+    if (lifetime == 0)
+        lifetime = store_lifetime;
+    if (lifetime > 0)
+        k->expires = monotonic_secs() + lifetime;
+
+    // Adding a key again replaces it, with its new comment and lifetime
+    if (*(old = find_key(k->blob, k->blob_len)) != NULL) {
+        struct local_key *o = *old;
+        *old = o->next;
+        key_free(o);
+    }
+    k->next = keys;
+    keys = k;
+    if (k->expires) {
+        // In the daemon rather than at keystore_init(), which is before it forks
+        pthread_once(&reaper_once, start_reaper);
+        timer_add(&key_timers, &k->lifetime_timer, k->expires);
+        if (reaper_running)
+            pthread_cond_signal(&key_timers_armed);
+    }
+    return 0;
+}
+
+
+static int
+remove_key(struct reader *r)
+{
+    const uint8_t *blob;
+    uint32_t len;
+    struct local_key **kp, *k;
+
+    if ((blob = read_string(r, &len)) == NULL || (k = *(kp = find_key(blob, len))) == NULL)
+        return -1;
+    *kp = k->next;
+    key_free(k);
+    return 0;
+}
+
+
+static void
+list_keys(uint8_t *buf)
+{
+    struct writer w = { buf, 0, AGENT_MAX_MSGLEN, 0 };
+    struct local_key *k;
+    uint32_t n = 0;
+
+    write_u32(&w, 0);
+    write_byte(&w, SSH_AGENT_IDENTITIES_ANSWER);
+    write_u32(&w, 0);
+    for (k = store_locked ? NULL : keys; k; k = k->next, ++n) {
+        write_string(&w, k->blob, k->blob_len);
+        write_string(&w, k->comment, k->comment_len);
+    }
+    if (w.err) {
+        warnx("local keys do not fit in an identities answer");
+        n = 0;
+        w.len = 9;
+    }
+    put_u32(buf, (uint32_t)w.len - 4);
+    put_u32(buf + 5, n);
+}
+
+
+// Write the signature blob of data: the algorithm name and the signature.
+static int
+sign_data(const struct local_key *k, const uint8_t *data, uint32_t len, uint32_t flags, struct writer *sig)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    const EVP_MD *md = NULL;
+    const char *name = k->type->name;
+    uint8_t raw[MAX_BLOB];
+    size_t raw_len = sizeof(raw);
+    int res = -1;
+
+    if (k->type->kind == KEY_ECDSA) {
+        int bits = EVP_PKEY_get_bits(k->pkey);
+        md = bits <= 256 ? EVP_sha256() : bits <= 384 ? EVP_sha384() : EVP_sha512();
+    }
+    else if (k->type->kind == KEY_RSA) {
+        if (flags & SSH_AGENT_RSA_SHA2_512) {
+            md = EVP_sha512();
+            name = "rsa-sha2-512";
+        }
+        else if (flags & SSH_AGENT_RSA_SHA2_256) {
+            md = EVP_sha256();
+            name = "rsa-sha2-256";
+        }
+        else
+            md = EVP_sha1();
+    }
+
+    if (!ctx || EVP_DigestSignInit(ctx, NULL, md, NULL, k->pkey) <= 0 ||
+        EVP_DigestSign(ctx, raw, &raw_len, data, len) <= 0)
+        goto out;
+
+    write_cstring(sig, name);
+    if (k->type->kind == KEY_ECDSA) {
+        // DER from OpenSSL, two mpints in SSH
+        const uint8_t *der = raw;
+        ECDSA_SIG *es = d2i_ECDSA_SIG(NULL, &der, (long)raw_len);
+        uint8_t inner_buf[MAX_BLOB / 2];
+        struct writer inner = { inner_buf, 0, sizeof(inner_buf), 0 };
+
+        if (!es)
+            goto out;
+        write_bn(&inner, ECDSA_SIG_get0_r(es));
+        write_bn(&inner, ECDSA_SIG_get0_s(es));
+        ECDSA_SIG_free(es);
+        if (inner.err)
+            goto out;
+        write_string(sig, inner.p, inner.len);
+    }
+    else
+        write_string(sig, raw, raw_len);
+    res = sig->err ? -1 : 0;
+
+out:
+    EVP_MD_CTX_free(ctx);
+    return res;
+}
+
+
+static int
+sign_request(struct reader *r, uint8_t *buf)
+{
+    uint8_t sig_buf[MAX_BLOB];
+    struct writer sig = { sig_buf, 0, sizeof(sig_buf), 0 };
+    struct writer w = { buf, 0, AGENT_MAX_MSGLEN, 0 };
+    const uint8_t *blob, *data;
+    uint32_t blob_len, len, flags;
+    struct local_key *k;
+
+    blob = read_string(r, &blob_len);
+    data = read_string(r, &len);
+    flags = read_u32(r);
+    if (r->err || store_locked || (k = *find_key(blob, blob_len)) == NULL ||
+        sign_data(k, data, len, flags, &sig) != 0)
+        return -1;
+
+    write_u32(&w, 0);
+    write_byte(&w, SSH_AGENT_SIGN_RESPONSE);
+    write_string(&w, sig.p, sig.len);
+    put_u32(buf, (uint32_t)w.len - 4);
+    return 0;
+}
+
+
+static int
+lock_store(struct reader *r, int lock)
+{
+    const uint8_t *pass;
+    uint32_t len;
+    uint8_t hash[sizeof(lock_hash)];
+
+    if ((pass = read_string(r, &len)) == NULL || store_locked == lock ||
+        !EVP_Digest(pass, len, hash, NULL, EVP_sha256(), NULL))
+        return -1;
+    if (lock)
+        memcpy(lock_hash, hash, sizeof(hash));
+    else if (CRYPTO_memcmp(hash, lock_hash, sizeof(hash)) != 0)
+        return -1;
+    store_locked = lock;
+    return 0;
+}
+
+
+// Answer a request in place.
+static void
+keystore_request(uint8_t *buf)
+{
+    size_t len = msglen(buf);
+    struct reader r = { buf + 5, len - 5, 0 };
+    int res = -1;
+
+    if (len < 5)
+        goto reply;
+    pthread_mutex_lock(&keys_lock);
+    remove_expired();
+    switch (buf[4]) {
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+        list_keys(buf);
+        pthread_mutex_unlock(&keys_lock);
+        return;
+    case SSH_AGENTC_SIGN_REQUEST:
+        res = sign_request(&r, buf);
+        pthread_mutex_unlock(&keys_lock);
+        if (res == 0)
+            return;
+        goto reply;
+    case SSH_AGENTC_ADD_IDENTITY:
+    case SSH_AGENTC_ADD_ID_CONSTRAINED:
+        if (!store_locked)
+            res = add_key(&r);
+        OPENSSL_cleanse(buf, len);  // the private key
+        break;
+    case SSH_AGENTC_REMOVE_IDENTITY:
+        if (!store_locked)
+            res = remove_key(&r);
+        break;
+    case SSH_AGENTC_REMOVE_ALL_IDENTITIES:
+        while (keys && !store_locked) {
+            struct local_key *k = keys;
+            keys = k->next;
+            key_free(k);
+        }
+        res = store_locked ? -1 : 0;
+        break;
+    case SSH_AGENTC_LOCK:
+    case SSH_AGENTC_UNLOCK:
+        res = lock_store(&r, buf[4] == SSH_AGENTC_LOCK);
+        break;
+    }
+    pthread_mutex_unlock(&keys_lock);
+
+reply:
+    put_u32(buf, 1);
+    buf[4] = res == 0 ? SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE;
+}
+
+
+static int
+keystore_submit(struct backend *b, uint8_t *const *bufs, int n)
+{
+    int i;
+
+    (void)b;
+    for (i = 0; i < n; ++i)
+        keystore_request(bufs[i]);
+    return 0;
+}
+
+
+static int
+keystore_complete(struct backend *b, uint8_t *const *bufs, int n)
+{
+    (void)b;
+    (void)bufs;
+    (void)n;
+    return 0;  // answered on submit
+}
+
+
+static void
+keystore_start(struct backend *b)
+{
+    (void)b;
+}
+
+
+static void
+keystore_release_idle(struct backend *b, int64_t idle_ms)
+{
+    (void)b;
+    (void)idle_ms;
+}
+
+
+static int
+keystore_healthy(struct backend *b)
+{
+    (void)b;
+    return 1;
+}
+
+
+static struct backend keystore_backend = {
+    "local keys",
+    keystore_submit,
+    keystore_complete,
+    keystore_start,
+    keystore_release_idle,
+    keystore_healthy,
+};
+
+
+struct backend *
+keystore_init(int mode, uint32_t default_lifetime)
+{
+    // Locked in memory, left out of core dumps and guarded by inaccessible
+    // pages. Without it (RLIMIT_MEMLOCK, say) keys could end up in swap.
+    if (CRYPTO_secure_malloc_init(SECURE_HEAP_SIZE, 32) != 1)
+        warnx("could not lock the memory for local keys in RAM, they may be swapped out");
+    store_mode = mode;
+    store_lifetime = default_lifetime;
+    timer_wheel_init(&key_timers, monotonic_secs());
+    return &keystore_backend;
+}
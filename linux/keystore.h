@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl in-process key store.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <stdint.h>
+
+#include "backend.h"
+
+#define KEYSTORE_ALL 1  // keep every key the store can sign with
+#define KEYSTORE_LIFETIME 2  // only keys added with a lifetime (ssh-add -t)
+
+// Keys added from WSL can be kept and used in the daemon rather than passed
+// on to the Windows agent, which saves signatures a trip across the interop
+// boundary. The store is a backend shared by all threads; it answers in
+// submit(). Private key material lives in OpenSSL's secure heap, which is
+// locked in memory. Keys without a lifetime of their own get default_lifetime
+// seconds, 0 for none. Returns NULL with a warning on errors.
+struct backend *keystore_init(int mode, uint32_t default_lifetime);
+
+// Whether an add request is one for the store: a key type it can sign with,
+// constraints it can enforce (not confirmation) and one that the mode takes.
+int keystore_accepts(const uint8_t *msg);
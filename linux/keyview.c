@@ -0,0 +1,329 @@
+/*
+ * ssh-agent-wsl per-socket key views.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "keyview.h"
+
+
+// Read an SSH string at *pos, not going past end.
+static int
+get_string(const uint8_t *msg, size_t *pos, size_t end, const uint8_t **data, uint32_t *len)
+{
+    if (end - *pos < 4)
+        return -1;
+    *len = get_u32(msg + *pos);
+    if (end - *pos - 4 < *len)
+        return -1;
+    *data = msg + *pos + 4;
+    *pos += 4 + *len;
+    return 0;
+}
+
+
+static int
+key_blob_cmp(const void *a, const void *b)
+{
+    const struct key_blob *ka = a, *kb = b;
+
+    if (ka->len != kb->len)
+        return ka->len < kb->len ? -1 : 1;
+    return memcmp(ka->data, kb->data, ka->len);
+}
+
+
+static int
+base64_value(int c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+
+// Decode base64 text up to the first non-base64 character. Returns the
+// decoded length, or -1 on malformed input.
+static int
+base64_decode(const char *in, uint8_t *out, size_t outlen)
+{
+    uint32_t acc = 0;
+    int bits = 0, v;
+    size_t n = 0;
+
+    for (; *in && *in != '='; ++in) {
+        if ((v = base64_value((unsigned char)*in)) < 0)
+            break;
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == outlen)
+                return -1;
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return (int)n;
+}
+
+
+struct key_view *
+key_view_load(const char *path)
+{
+    char line[16384];
+    uint8_t blob[sizeof(line)];
+    size_t cap = 0;
+    int lineno = 0;
+    FILE *f;
+    struct key_view *view = calloc(1, sizeof(*view));
+
+    if (!view) {
+        warnx("key_view_load: No memory");
+        return NULL;
+    }
+    snprintf(view->path, sizeof(view->path), "%s", path);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        warn("%s", path);
+        free(view);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *type, *b64, *save;
+        int len;
+
+        ++lineno;
+        type = strtok_r(line, " \t\r\n", &save);
+        if (!type || type[0] == '#')
+            continue;
+        b64 = strtok_r(NULL, " \t\r\n", &save);
+        if (!b64 || (len = base64_decode(b64, blob, sizeof(blob))) <= 0) {
+            warnx("%s:%d: not a public key", path, lineno);
+            continue;
+        }
+
+        if (view->nkeys == cap) {
+            struct key_blob *keys;
+            cap = cap ? cap * 2 : 8;
+            if ((keys = realloc(view->keys, cap * sizeof(*keys))) == NULL) {
+                warnx("key_view_load: No memory");
+                break;
+            }
+            view->keys = keys;
+        }
+        if ((view->keys[view->nkeys].data = malloc((size_t)len)) == NULL) {
+            warnx("key_view_load: No memory");
+            break;
+        }
+        memcpy(view->keys[view->nkeys].data, blob, (size_t)len);
+        view->keys[view->nkeys].len = (uint32_t)len;
+        ++view->nkeys;
+    }
+    fclose(f);
+
+    qsort(view->keys, view->nkeys, sizeof(*view->keys), key_blob_cmp);
+    return view;
+}
+
+
+int
+key_view_contains(const struct key_view *view, const uint8_t *blob, uint32_t len)
+{
+    struct key_blob key = { len, (uint8_t *)blob };
+
+    return bsearch(&key, view->keys, view->nkeys, sizeof(*view->keys), key_blob_cmp) != NULL;
+}
+
+
+size_t
+key_view_filter(const struct key_view *view, const uint8_t *answer, uint8_t *out, size_t outlen)
+{
+    size_t end = msglen(answer), pos = 5, outpos = 9;
+    uint32_t i, nkeys, nout = 0;
+
+    if (end < 9 || answer[4] != SSH_AGENT_IDENTITIES_ANSWER || outlen < 9)
+        return 0;
+    nkeys = get_u32(answer + pos);
+    pos += 4;
+
+    for (i = 0; i < nkeys; ++i) {
+        const uint8_t *blob, *comment;
+        uint32_t blob_len, comment_len;
+        size_t start = pos;
+
+        if (get_string(answer, &pos, end, &blob, &blob_len) < 0 ||
+            get_string(answer, &pos, end, &comment, &comment_len) < 0)
+            return 0;
+        if (!key_view_contains(view, blob, blob_len))
+            continue;
+        if (outlen - outpos < pos - start)
+            return 0;
+        memcpy(out + outpos, answer + start, pos - start);
+        outpos += pos - start;
+        ++nout;
+    }
+
+    put_u32(out, (uint32_t)(outpos - 4));
+    out[4] = SSH_AGENT_IDENTITIES_ANSWER;
+    put_u32(out + 5, nout);
+    return outpos;
+}
+
+
+int
+agent_sign_request_key(const uint8_t *msg, const uint8_t **blob, uint32_t *len)
+{
+    size_t pos = 5;
+
+    if (msglen(msg) < 5 || msg[4] != SSH_AGENTC_SIGN_REQUEST)
+        return -1;
+    return get_string(msg, &pos, msglen(msg), blob, len);
+}
+
+
+int
+agent_request_key(const uint8_t *msg, const uint8_t **blob, uint32_t *len)
+{
+    size_t pos = 5;
+
+    if (msglen(msg) < 5 || (msg[4] != SSH_AGENTC_SIGN_REQUEST && msg[4] != SSH_AGENTC_REMOVE_IDENTITY))
+        return -1;
+    return get_string(msg, &pos, msglen(msg), blob, len);
+}
+
+
+static uint64_t
+blob_hash(const uint8_t *blob, uint32_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    uint32_t i;
+
+    for (i = 0; i < len; ++i)
+        h = (h ^ blob[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+// Find the slot of a key, or the free slot where it would go.
+static struct key_index_slot *
+key_index_slot(const struct key_index *index, const uint8_t *answer, const uint8_t *blob, uint32_t len,
+               uint64_t hash)
+{
+    size_t i = (size_t)hash & index->mask;
+
+    while (1) {
+        struct key_index_slot *slot = &index->slots[i];
+
+        if (slot->offset == 0)
+            return slot;
+        if (slot->hash == hash && get_u32(answer + slot->offset) == len &&
+            memcmp(answer + slot->offset + 4, blob, len) == 0)
+            return slot;
+        i = (i + 1) & index->mask;
+    }
+}
+
+
+size_t
+identities_merge(const uint8_t *const *answers, int n, uint8_t *out, size_t outlen, struct key_index *index)
+{
+    size_t outpos = 9, slots = 16, keys = 0;
+    uint32_t nout = 0;
+    int a;
+
+    // Each key takes at least 8 bytes, which bounds what the counts can claim
+    for (a = 0; a < n; ++a) {
+        if (answers[a] && msglen(answers[a]) >= 9 && answers[a][4] == SSH_AGENT_IDENTITIES_ANSWER) {
+            size_t nkeys = get_u32(answers[a] + 5);
+            keys += nkeys < msglen(answers[a]) / 8 ? nkeys : msglen(answers[a]) / 8;
+        }
+    }
+    while (slots < 2 * keys)
+        slots *= 2;
+    index->mask = slots - 1;
+    if (outlen < 9 || (index->slots = calloc(slots, sizeof(*index->slots))) == NULL)
+        return 0;
+
+    for (a = 0; a < n; ++a) {
+        const uint8_t *answer = answers[a];
+        size_t end, pos = 9;
+        uint32_t i, nkeys;
+
+        if (!answer || msglen(answer) < 9 || answer[4] != SSH_AGENT_IDENTITIES_ANSWER)
+            continue;
+        end = msglen(answer);
+        nkeys = get_u32(answer + 5);
+
+        for (i = 0; i < nkeys; ++i) {
+            const uint8_t *blob, *comment;
+            uint32_t blob_len, comment_len;
+            size_t start = pos;
+            uint64_t hash;
+            struct key_index_slot *slot;
+
+            if (get_string(answer, &pos, end, &blob, &blob_len) < 0 ||
+                get_string(answer, &pos, end, &comment, &comment_len) < 0)
+                break;  // keep what could be read
+            hash = blob_hash(blob, blob_len);
+            slot = key_index_slot(index, out, blob, blob_len, hash);
+            if (slot->offset != 0)
+                continue;  // listed already
+            if (outlen - outpos < pos - start)
+                goto fail;
+            memcpy(out + outpos, answer + start, pos - start);
+            slot->hash = hash;
+            slot->offset = (uint32_t)outpos;
+            slot->value = a;
+            outpos += pos - start;
+            ++nout;
+        }
+    }
+
+    put_u32(out, (uint32_t)(outpos - 4));
+    out[4] = SSH_AGENT_IDENTITIES_ANSWER;
+    put_u32(out + 5, nout);
+    return outpos;
+
+fail:
+    key_index_free(index);
+    return 0;
+}
+
+
+int
+key_index_find(const struct key_index *index, const uint8_t *answer, const uint8_t *blob, uint32_t len)
+{
+    const struct key_index_slot *slot;
+
+    if (!index->slots)
+        return -1;
+    slot = key_index_slot(index, answer, blob, len, blob_hash(blob, len));
+    return slot->offset != 0 ? slot->value : -1;
+}
+
+
+void
+key_index_free(struct key_index *index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
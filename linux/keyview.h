@@ -0,0 +1,73 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl per-socket key views.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct key_blob {
+    uint32_t len;
+    uint8_t *data;
+};
+
+// Allowlist of public keys attached to a listening socket. Only these keys
+// are listed to and may be used by the clients of that socket.
+struct key_view {
+    char path[PATH_MAX];
+    size_t nkeys;
+    struct key_blob *keys;  // sorted, see key_blob_cmp()
+};
+
+// Load an allowlist from a file of OpenSSH public keys, one per line
+// ("type base64 [comment]", as in .pub files). Returns NULL with a warning
+// on errors.
+struct key_view *key_view_load(const char *path);
+
+int key_view_contains(const struct key_view *view, const uint8_t *blob, uint32_t len);
+
+// Copy an SSH_AGENT_IDENTITIES_ANSWER message to out, leaving only the keys
+// in the view. Returns the length of the new message or 0 if the answer is
+// malformed or does not fit.
+size_t key_view_filter(const struct key_view *view, const uint8_t *answer, uint8_t *out, size_t outlen);
+
+// Hash index of the keys of an identities answer, giving the number of the
+// answer each came from when several were merged. Slots refer to keys by
+// their offset in the answer, so it also holds for a copy of the answer.
+struct key_index_slot {
+    uint64_t hash;
+    uint32_t offset;  // of the key blob string, 0 for a free slot
+    int value;
+};
+
+struct key_index {
+    size_t mask;  // number of slots - 1
+    struct key_index_slot *slots;
+};
+
+// Merge the SSH_AGENT_IDENTITIES_ANSWER messages answers[0..n-1] into out,
+// keeping their order but listing each key only once, where it first appears.
+// NULL answers and other messages are skipped, and so is the rest of a
+// malformed answer. The keys are entered in index with the number of their
+// answer. Returns the length of the new message or 0 if the keys do not fit or
+// there is no memory.
+size_t identities_merge(const uint8_t *const *answers, int n, uint8_t *out, size_t outlen, struct key_index *index);
+
+// Returns the value of a key in the index of answer, or -1 if it is not there.
+int key_index_find(const struct key_index *index, const uint8_t *answer, const uint8_t *blob, uint32_t len);
+
+void key_index_free(struct key_index *index);
+
+// Find the key blob of an SSH_AGENTC_SIGN_REQUEST message. Returns 0 on
+// success, -1 if the message is malformed.
+int agent_sign_request_key(const uint8_t *msg, const uint8_t **blob, uint32_t *len);
+
+// Same for the requests which name a key: signing and removing one.
+int agent_request_key(const uint8_t *msg, const uint8_t **blob, uint32_t *len);
@@ -10,6 +10,7 @@
  * version 3 of the License, or (at your option) any later version.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <err.h>
 #include <getopt.h>
@@ -19,20 +20,34 @@
 #include <string.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <spawn.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
-#include <arpa/inet.h>  // needed by common.h
 
 #include "../common.h"
+#include "backend.h"
+#include "keystore.h"
+#include "keyview.h"
+#include "timerwheel.h"
+#if HAVE_IO_URING
+#include "uring.h"
+#endif
 
 // As of FCU (including earlier releases), a Win32 subprocess is in some
 // sort of relationship with the conhost of the window in which it was started.
@@ -48,30 +63,213 @@
 
 typedef enum {UNKNOWN, BOURNE, C_SH, FISH} shell_type;
 
+// Long-only options, kept out of the range of the short option characters.
+enum {
+    OPT_DRAIN_TIMEOUT = 0x100,
+    OPT_UPGRADE_FD,
+    OPT_SHARED,
+    OPT_VIEW,
+    OPT_CACHE_TTL,
+    OPT_PROBE_TIMEOUT,
+    OPT_ENV_FILE,
+    OPT_IDLE_TIMEOUT,
+    OPT_HELPER_IDLE,
+    OPT_PREWARM,
+    OPT_CLIENT_TIMEOUT,
+    OPT_MAX_CLIENTS,
+    OPT_MAX_QUEUE,
+    OPT_INTERACTIVE_WEIGHT,
+    OPT_WORKERS,
+    OPT_IO_URING,
+    OPT_SPLICE,
+    OPT_BATCH,
+    OPT_UPSTREAM,
+    OPT_KEEP_HELPER,
+    OPT_LOCAL_KEYS,
+    OPT_RELAY,
+    OPT_HEDGE,
+    OPT_HEDGE_SIGN,
+    OPT_PREFETCH,
+};
+
+#define MAX_LISTENERS 8
+
+// First descriptor passed by a service manager on socket activation
+#define LISTEN_FDS_START 3
+
+// Sockets handed over to the new binary on --upgrade travel over a
+// SOCK_SEQPACKET pair, one tagged message per batch of descriptors.
+#define UPGRADE_FDS_PER_MSG 64
+
+struct upgrade_msg {
+    char tag;  // 'L' listening sockets and paths, 'C' idle clients, 'E' end
+    char sockpath[PATH_MAX];
+    char tempdir[PATH_MAX];
+    char pidpath[PATH_MAX];
+    uint8_t activated;  // number of listeners when they came from a service manager
+    uint8_t owner[UPGRADE_FDS_PER_MSG];  // listener index of each client
+};
+
+// A listening socket. The first one is the SSH_AUTH_SOCK socket, the others
+// are added with --listen and may restrict their clients to a --view.
+struct listener {
+    int fd;
+    const char *name;  // path given with --listen
+    char path[PATH_MAX];  // removed on exit, set once bound
+    const char *view_name;
+    struct key_view *view;
+    int abstract;  // no filesystem permissions, so peers are checked on accept
+};
+
+struct inherited_client {
+    int fd;
+    int listener;
+};
+
 struct fd_buf {
     ssize_t recv, send;
+    int fd;
+    struct listener *listener;
+    struct timer idle_timer;  // runs out after --client-timeout without progress
+    struct fd_buf *lru_prev, *lru_next;  // ordered by last progress, oldest first
+    int64_t touched_ms;  // time of the last progress
+    struct fd_buf *queue_next;
+    int queued;  // complete request waiting for its turn with the helper
+    int served;  // at least one reply sent, recv == 0 then means waiting for the next request
+    struct peer *peer;
+    uint64_t finish;  // virtual finish time while queued
+    size_t splice_in;  // rest of the request, left in the socket for --splice
+    int prefetched;  // connected while identities were being prefetched, until it lists them
     uint8_t buf[AGENT_MAX_MSGLEN];
 };
 
+// Last identities answer, shared by all listeners, with the answers filtered
+// for each view. It is served without asking the helper for --cache-ttl
+// seconds and forgotten after any request which may change the set of keys.
+// A snapshot is never modified once published. Threads take a reference to
+// the current one under id_cache_lock and read it without locking, and the
+// last reference frees it.
+struct id_snapshot {
+    int refs;  // the cache's own while it is current, and one per user
+    uint64_t generation;  // counts up with each snapshot, never reused
+    time_t fetched;
+    uint8_t *answer;
+    uint8_t *view_answer[MAX_LISTENERS];  // for listeners[i].view, NULL on errors
+    struct key_index owners;  // backend of each key, with more than one
+};
+
+static struct id_snapshot *id_cache = NULL;
+static uint64_t id_cache_generation = 0;  // of the last snapshot, under id_cache_lock
+
+// With --workers, the main loop only accepts connections and hands them to
+// worker threads in turn, each with its own connections, request queue and
+// helper. The state of a loop is thread local for that reason; the rest is
+// either read-only once the workers run (options, listeners, key views) or
+// published atomically (the identities cache, counters).
+struct worker {
+    pthread_t thread;
+    int handoff[2];  // struct handoff from the acceptor, closed to drain
+    int nclients;  // published by the worker for the acceptor
+    int nqueued;
+    int64_t oldest_idle_ms;  // last progress of its first --max-clients victim, 0 for none
+    int64_t busy_since;  // when its backend was given the request it serves, 0 for none
+};
+
+struct handoff {
+    int fd;  // EVICT_ONE to close the oldest idle connection
+    int listener;
+};
+
+#define EVICT_ONE (-1)
+
 static int opt_debug = 0;
 static int tty_gone = 0;
 static int opt_no_exit = 0;
+static int opt_drain_timeout = 5;  // seconds to finish in-flight requests after SIGTERM
+static int opt_cache_ttl = 0;
+static int opt_probe_timeout = 1000;  // ms for an existing agent to answer on --reuse
+static int opt_idle_timeout = 0;  // seconds without connections before exiting, 0 to never exit
+static int opt_helper_idle = 0;  // seconds without requests before stopping the helper, 0 to keep it
+static int opt_prewarm = 0;  // start the helper as soon as a client connects
+static int opt_prefetch = 0;  // ask for the identities as soon as a client connects
+static int opt_client_timeout = 0;  // seconds a connection may go without progress, 0 for no limit
+static int opt_max_clients = 0;  // connections beyond this evict the oldest idle one, 0 for no limit
+static int opt_max_queue = 0;  // requests waiting for the helper beyond this fail at once, 0 for no limit
+static int opt_interactive_weight = 8;  // share of the helper of a foreground terminal process
+
+static volatile sig_atomic_t drain_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+// Load shedding counters, logged on SIGUSR1
+static unsigned long shed_requests = 0;  // updated atomically
+static unsigned long accept_pauses = 0;
+static int accept_paused = 0;  // published by the acceptor for the workers
+static int acceptor_wake[2] = { -1, -1 };  // workers write to it once they close a connection meanwhile
+
+static int opt_workers = 0;
+static struct worker *workers = NULL;
+static int64_t acceptor_busy_since = 0;  // as struct worker's, without --workers
+static int opt_io_uring = 0;
+static int opt_splice = 0;
+static int opt_batch = 1;  // requests passed to the helper in one write
+static int opt_hedge = 0;  // HEDGE_* flags
+
+#define MAX_BATCH BACKEND_MAX_BATCH
+
+// Requests and replies of at least this size are moved between the socket and
+// the helper with splice() by --splice, smaller ones are cheaper to copy.
+#define SPLICE_MIN 4096
+
+#if HAVE_IO_URING
+// Each thread has a ring of its own, set up on first use
+#define RING_ENTRIES 256
+static __thread struct uring *ring = NULL;
+static __thread int ring_failed = 0;  // io_uring is not available, don't try again
+#endif
+
+// Original command line, used to exec a new binary with the same options on --upgrade
+static char self_exe_path[PATH_MAX] = "";
+static int saved_argc = 0;
+static char **saved_argv = NULL;
+static int inherited_children = 0;  // set when started by --upgrade
+static int socket_activated = 0;  // listeners are owned by a service manager
 
 static pid_t subcommand_pid = 0;
-static pid_t win32_pid = 0;
-static int win32_in = -1;  // input from the win32 helper (connected to its stdout)
-static int win32_out = -1;  // output to the win32 helper (connected to its stdin)
+// Each worker thread has a helper of its own
+static __thread pid_t win32_pid = 0;
+static __thread pid_t win32_retired_pid = 0;  // helper stopped for being idle, not reaped yet
+static __thread int64_t win32_last_used = 0;  // monotonic_ms() of the last query
+static __thread int win32_in = -1;  // input from the win32 helper (connected to its stdout)
+static __thread int win32_out = -1;  // output to the win32 helper (connected to its stdin)
+static __thread size_t win32_pipe_size = 65536;  // capacity of win32_out
+static __thread size_t win32_reply_got = 0;  // bytes of the reply read along with the request
+static int win32_start_failed = 0;  // updated atomically
+static pid_t win32_relay_pid = 0;  // last relay started for --relay, not reaped yet
 static char win32_helper_path[PATH_MAX] = "./pipe-connector.exe";
 
+// Answer the requests: the Win32 helper unless --upstream is given. With more
+// than one, identities are the merged lists of all of them, in this order.
+static struct backend win32_backend;
+static struct backend *backends[MAX_BACKENDS] = { &win32_backend };
+static int nbackends = 1;
+static int default_backend = 0;  // for requests which are not for a particular one
+static struct backend *local_backend = NULL;  // --local-keys, also in backends
+static __thread uint8_t *fanout_bufs[MAX_BACKENDS];  // for the replies of all backends
+
+static struct listener listeners[MAX_LISTENERS];
+static int nlisteners = 1;
+
 static char cleanup_tempdir[PATH_MAX] = "";
-static char cleanup_sockpath[PATH_MAX] = "";
+static char cleanup_pidpath[PATH_MAX] = "";
+static char cleanup_envpath[PATH_MAX] = "";
 
 
 static void cleanup_exit(int status) __attribute__((noreturn));
 static void cleanup_warn(const char *prefix) __attribute__((noreturn));
 static void cleanup_signal(int sig);
 
-static void do_agent_loop(int sockfd) __attribute__((noreturn));
+static void do_agent_loop(const struct inherited_client *clients, int nclients) __attribute__((noreturn));
 
 
 static void
@@ -90,10 +288,36 @@ debug_print(const char *fmt, ...)
 }
 
 
+// --env-file writes one file per shell flavour, PATH itself is for Bourne shells
+static const char *env_file_suffix[] = { "", ".csh", ".fish" };
+
+
+static void
+remove_env_files()
+{
+    char path[PATH_MAX + 8];
+    size_t i;
+
+    if (!cleanup_envpath[0])
+        return;
+    for (i = 0; i < sizeof(env_file_suffix) / sizeof(env_file_suffix[0]); ++i) {
+        snprintf(path, sizeof(path), "%s%s", cleanup_envpath, env_file_suffix[i]);
+        unlink(path);
+    }
+    cleanup_envpath[0] = 0;
+}
+
+
 static void
 cleanup_exit(int status)
 {
-    unlink(cleanup_sockpath);
+    int i;
+    for (i = 0; i < nlisteners; ++i) {
+        if (listeners[i].path[0])
+            unlink(listeners[i].path);
+    }
+    unlink(cleanup_pidpath);
+    remove_env_files();
     rmdir(cleanup_tempdir);
     exit(status);
 }
@@ -154,6 +378,12 @@ cleanup_signal(int sig)
     // but when a child exits, copy its exit status so ssh-agent-wsl is more
     // effective as a command wrapper.
     int status = 0;
+    if (sig == SIGTERM && !drain_requested) {
+        // First SIGTERM only asks the main loop to stop accepting and let
+        // in-flight requests finish. Any further signal exits immediately.
+        drain_requested = 1;
+        return;
+    }
     if (sig == SIGCHLD) {
         if (subcommand_pid > 0 && (status = wait_subcommand(WNOHANG)) >= 0) {
             // Fall through to exit.
@@ -164,6 +394,22 @@ cleanup_signal(int sig)
             cleanup_win32(0);
             return;
         }
+        else if (win32_retired_pid > 0 && waitpid(win32_retired_pid, NULL, WNOHANG) > 0) {
+            // An idle helper we have asked to exit did so
+            win32_retired_pid = 0;
+            return;
+        }
+        else if (win32_relay_pid > 0 && waitpid(win32_relay_pid, NULL, WNOHANG) > 0) {
+            // The relay went away, it is started again by the next request
+            win32_relay_pid = 0;
+            return;
+        }
+        else if ((inherited_children || opt_workers > 0) && waitpid(-1, NULL, WNOHANG) > 0) {
+            // The helper or the draining process of the binary we replaced on
+            // --upgrade went away, they are still our children. Or the helper
+            // of a worker thread did, which notices on its own.
+            return;
+        }
         else {
             // This shouldn't happen. Exit in case subcommand tracking failed (this
             // is what we silently did before).
@@ -175,10 +421,58 @@ cleanup_signal(int sig)
 }
 
 
+static void
+upgrade_signal(int sig)
+{
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+
+static void
+stats_signal(int sig)
+{
+    (void)sig;
+    stats_requested = 1;
+}
+
+
+// $XDG_RUNTIME_DIR if it is set and private to the user, otherwise NULL.
+// It is normally a tmpfs which is cleaned up on logout, so sockets placed
+// there need neither a temporary directory of their own nor cleanup after
+// a crash.
+static const char *
+get_runtime_dir()
+{
+    struct stat st;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (!dir || dir[0] != '/' || strlen(dir) > PATH_MAX - 32)
+        return NULL;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & (S_IRWXG | S_IRWXO)))
+        return NULL;
+    return dir;
+}
+
+
+static int
+path_is_socket(const char *path);
+
+
 // Create a temporary path for the socket.
 static void
 create_socket_path(char* sockpath, size_t len)
 {
+    const char *runtime_dir = get_runtime_dir();
+    if (runtime_dir) {
+        snprintf(sockpath, len, "%s/ssh-agent-wsl.%d", runtime_dir, getpid());
+        // Nobody else can have our pid, it is left over from a crash
+        if (path_is_socket(sockpath))
+            unlink(sockpath);
+        return;
+    }
+
     char tempdir[] = "/tmp/ssh-XXXXXX";
     if (!mkdtemp(tempdir))
         cleanup_warn("mkdtemp");
@@ -190,11 +484,34 @@ create_socket_path(char* sockpath, size_t len)
 }
 
 
-// Prepare the socket at the given path.
+// Fill in the address of a socket path. A leading '@' selects the Linux
+// abstract namespace: nothing is created on the filesystem and the name
+// disappears with the last descriptor.
+static socklen_t
+socket_address(const char *sockpath, struct sockaddr_un *addr)
+{
+    size_t len = strlen(sockpath);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (sockpath[0] == '@') {
+        if (len > sizeof(addr->sun_path))
+            len = sizeof(addr->sun_path);
+        memcpy(addr->sun_path + 1, sockpath + 1, len - 1);
+        return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+    }
+    strncpy(addr->sun_path, sockpath, sizeof(addr->sun_path));
+    return sizeof(*addr);
+}
+
+
+// Prepare the socket at the given path, the path is copied to cleanup_path
+// once the socket is bound.
 static int
-open_auth_socket(const char* sockpath)
+open_auth_socket(const char* sockpath, char *cleanup_path)
 {
     struct sockaddr_un addr;
+    socklen_t addrlen;
     mode_t um;
     int fd;
 
@@ -202,16 +519,16 @@ open_auth_socket(const char* sockpath)
     if (fd < 0)
         cleanup_warn("socket");
 
-    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path));
-    addr.sun_family = AF_UNIX;
+    addrlen = socket_address(sockpath, &addr);
 
     um = umask(S_IXUSR | S_IRWXG | S_IRWXO);
-    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0)
         cleanup_warn("bind");
     umask(um);
 
-    // NB: Don't set cleanup_sockpath until after it's bound
-    strncpy(cleanup_sockpath, sockpath, sizeof(cleanup_sockpath));
+    // NB: Don't set the cleanup path until after it's bound
+    if (sockpath[0] != '@')
+        strncpy(cleanup_path, sockpath, PATH_MAX);
 
     if (listen(fd, 128) < 0)
         cleanup_warn("listen");
@@ -220,6 +537,95 @@ open_auth_socket(const char* sockpath)
 }
 
 
+static int
+socket_is_abstract(int fd)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        return 0;
+    return len > offsetof(struct sockaddr_un, sun_path) && addr.sun_path[0] == 0;
+}
+
+
+static int
+peer_is_same_user(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == getuid();
+}
+
+
+// Name of the socket bound to fd, in the form accepted by -a
+static void
+socket_name(int fd, char *name, size_t len)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = sizeof(addr);
+    size_t pathlen;
+
+    name[0] = 0;
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+        addrlen <= offsetof(struct sockaddr_un, sun_path))
+        return;
+    pathlen = addrlen - offsetof(struct sockaddr_un, sun_path);
+    if (addr.sun_path[0] == 0)
+        snprintf(name, len, "@%.*s", (int)pathlen - 1, addr.sun_path + 1);
+    else
+        snprintf(name, len, "%.*s", (int)strnlen(addr.sun_path, pathlen), addr.sun_path);
+}
+
+
+// Take over listening sockets passed by a service manager (the LISTEN_FDS
+// protocol of systemd socket activation). The manager keeps owning them, so
+// they are neither unlinked on exit nor handed back: connections arriving
+// after an idle exit wait in the queue until the agent is started again.
+// Returns the number of sockets taken over.
+static int
+inherit_listen_fds(char *sockpath, size_t len)
+{
+    const char *pid_env = getenv("LISTEN_PID");
+    const char *fds_env = getenv("LISTEN_FDS");
+    int i, n;
+
+    if (!pid_env || !fds_env || atoi(pid_env) != getpid())
+        return 0;
+    n = atoi(fds_env);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (n <= 0)
+        return 0;
+    if (n > MAX_LISTENERS) {
+        warnx("only using the first %d of %d inherited sockets", MAX_LISTENERS, n);
+        n = MAX_LISTENERS;
+    }
+
+    for (i = 0; i < n; ++i) {
+        int fd = LISTEN_FDS_START + i;
+        int type;
+        socklen_t optlen = sizeof(type);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0 || type != SOCK_STREAM)
+            errx(1, "inherited descriptor %d is not a stream socket", fd);
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+            err(1, "fcntl(%d)", fd);
+        listeners[i].fd = fd;
+        listeners[i].path[0] = 0;
+    }
+    nlisteners = n;
+    socket_activated = 1;
+    socket_name(listeners[0].fd, sockpath, len);
+    debug_print("socket activated with %d socket(s), first %s", n, sockpath);
+    return n;
+}
+
+
 static int
 path_is_socket(const char *path)
 {
@@ -232,13 +638,262 @@ path_is_socket(const char *path)
 }
 
 
-// Try to reuse an existing socket path.  For now, just being able to connect
-// will be deemed good enough.  If it can't connect, but is still a socket, try
-// to remove it.  Return 0 if the path was simply not connectible, else exit.
+static int64_t
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Wait up to the deadline for fd to become ready for events.
+static int
+poll_until(int fd, short events, int64_t deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int64_t left;
+    int res;
+
+    while ((left = deadline - monotonic_ms()) > 0) {
+        if ((res = poll(&pfd, 1, (int)left)) > 0)
+            return 1;
+        if (res < 0 && errno != EINTR)
+            return 0;
+    }
+    return 0;
+}
+
+
+// Receive exactly len bytes before the deadline.
+static int
+recv_until(int fd, uint8_t *buf, size_t len, int64_t deadline)
+{
+    while (len > 0) {
+        ssize_t cnt;
+
+        if (!poll_until(fd, POLLIN, deadline))
+            return 0;
+        cnt = recv(fd, buf, len, 0);
+        if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (cnt <= 0)
+            return 0;
+        buf += cnt;
+        len -= (size_t)cnt;
+    }
+    return 1;
+}
+
+
+// A request which has waited this long for its backend is taken for hung
+// rather than for a PIN or a confirmation still being entered.
+#define BUSY_STUCK_MS 60000
+
+
+// Make sure that the agent on the other end of fd actually works: send it an
+// extension query, which every agent answers (if only with a failure) and
+// which ssh-agent-wsl passes through to the Windows side, so a stuck helper
+// is noticed as well. Returns 1 if a complete reply arrived in time.
+static int
+probe_agent(int fd)
+{
+    static const uint8_t query[] = { 0, 0, 0, 10, SSH_AGENTC_EXTENSION, 0, 0, 0, 5, 'q', 'u', 'e', 'r', 'y' };
+    uint8_t buf[4096];
+    size_t rem;
+    int64_t deadline = monotonic_ms() + opt_probe_timeout;
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        return 0;
+    if (!poll_until(fd, POLLOUT, deadline) || send(fd, query, sizeof(query), 0) != sizeof(query))
+        return 0;
+
+    if (!recv_until(fd, buf, 4, deadline))
+        return 0;
+    if (frame_check(buf, 4, AGENT_MAX_MSGLEN) == FRAME_TOO_LONG)
+        return 0;
+    rem = msglen(buf) - 4;
+    while (rem > 0) {
+        size_t chunk = rem < sizeof(buf) ? rem : sizeof(buf);
+        if (!recv_until(fd, buf, chunk, deadline))
+            return 0;
+        rem -= chunk;
+    }
+    return 1;
+}
+
+
+// The probe waits behind the requests in flight, which may be waiting for a
+// PIN or a confirmation on the Windows side. Meanwhile the agent tells how
+// long it has been waiting on its own abstract socket, which a thread of its
+// own answers.
+static socklen_t
+busy_socket_address(pid_t pid, struct sockaddr_un *addr)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "@ssh-agent-wsl-busy-%d", (int)pid);
+    return socket_address(name, addr);
+}
+
+
+// How long the agent pid has been waiting on its backend, in ms, 0 if it is
+// not, or -1 if it does not say.
+static int64_t
+agent_busy_ms(pid_t pid)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = busy_socket_address(pid, &addr);
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    uint8_t buf[4];
+    int64_t busy = -1;
+    int fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (fd < 0)
+        return -1;
+    // The name is not reserved, so it must be the agent's own
+    if (connect(fd, (struct sockaddr *)&addr, addrlen) == 0 &&
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.pid == pid &&
+        recv_until(fd, buf, sizeof(buf), monotonic_ms() + opt_probe_timeout))
+        busy = get_u32(buf);
+    close(fd);
+    return busy;
+}
+
+
+// Of a stuck agent, one per worker
+#define MAX_HELPERS_KILLED 64
+
+
+// Find the helpers of an agent, which are started as "helper FLAGS" and would
+// outlive it if they are stuck themselves. A --relay (more arguments) serves
+// other agents as well and a subcommand is the user's, both are left alone.
+static int
+agent_helpers(pid_t agent, pid_t *pids, int max)
+{
+    char path[64], buf[512], *p;
+    struct dirent *de;
+    DIR *dir;
+    ssize_t len;
+    pid_t pid;
+    int fd, ppid, n = 0;
+
+    if ((dir = opendir("/proc")) == NULL)
+        return 0;
+    while (n < max && (de = readdir(dir)) != NULL) {
+        if ((pid = atoi(de->d_name)) <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        buf[len] = 0;
+        if ((p = strrchr(buf, ')')) == NULL || sscanf(p + 1, " %*c %d", &ppid) != 1 || ppid != agent)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        buf[len] = 0;
+        p = buf + strlen(buf) + 1;  // the flags
+        if (p < buf + len && strlen(p) == 8 && strspn(p, "0123456789") == 8 && p + 9 == buf + len)
+            pids[n++] = pid;
+    }
+    closedir(dir);
+    return n;
+}
+
+
+static pid_t
+read_pid_file(const char *path)
+{
+    char buf[16];
+    ssize_t cnt;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return 0;
+    cnt = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (cnt <= 0)
+        return 0;
+    buf[cnt] = 0;
+    return (pid_t)atoi(buf);
+}
+
+
+// Kill an agent which failed the probe, with its helpers, and wait until its
+// socket is released (or somebody else has already replaced it). The socket
+// file is left for reuse_socket_path() to remove, unless a new agent has
+// taken it over meanwhile. The pid file of --shared goes if it names the
+// agent killed.
+static int
+replace_stuck_agent(int fd, const char *sockpath, const char *pidpath)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int64_t deadline;
+    pid_t helpers[MAX_HELPERS_KILLED];
+    int nhelpers;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.pid <= 0 || cred.uid != getuid()) {
+        warnx("agent at %s is not responding and cannot be replaced", sockpath);
+        return 0;
+    }
+
+    warnx("agent pid %d at %s is not responding, replacing it", cred.pid, sockpath);
+    nhelpers = agent_helpers(cred.pid, helpers, sizeof(helpers) / sizeof(helpers[0]));
+    if (kill(cred.pid, SIGKILL) < 0 && errno != ESRCH) {
+        warn("kill(%d)", cred.pid);
+        return 0;
+    }
+    for (int i = 0; i < nhelpers; ++i) {
+        debug_print("killing helper pid %d of agent pid %d", helpers[i], cred.pid);
+        kill(helpers[i], SIGKILL);
+    }
+    if (pidpath[0] && read_pid_file(pidpath) == cred.pid)
+        unlink(pidpath);
+
+    deadline = monotonic_ms() + 1000;
+    while (monotonic_ms() < deadline) {
+        struct sockaddr_un addr;
+        socklen_t addrlen = socket_address(sockpath, &addr);
+        struct ucred now;
+        int probe = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int gone;
+
+        if (probe < 0)
+            return 0;
+        len = sizeof(now);
+        gone = connect(probe, (struct sockaddr *)&addr, addrlen) < 0 ||
+               getsockopt(probe, SOL_SOCKET, SO_PEERCRED, &now, &len) < 0 || now.pid != cred.pid;
+        close(probe);
+        if (gone)
+            return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+
+// Try to reuse an existing socket path.  The agent there has to answer a probe
+// within --probe-timeout or say that it is busy, otherwise it is killed and
+// replaced.  The pid file of --shared is pidpath.  If it can't
+// connect, but is still a socket, try to remove it.  Return 0 if the path was
+// simply not connectible, else exit.
 static int
-reuse_socket_path(const char* sockpath)
+reuse_socket_path(const char* sockpath, const char *pidpath)
 {
     struct sockaddr_un addr;
+    socklen_t addrlen;
     int fd;
 
     if (!sockpath[0])
@@ -249,18 +904,43 @@ reuse_socket_path(const char* sockpath)
     if (fd < 0)
         cleanup_warn("socket");
 
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path));
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-        // The sockpath is already accepting connections -- reuse!
+    addrlen = socket_address(sockpath, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, addrlen) == 0) {
+        // The sockpath is already accepting connections -- reuse, if it works!
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        int64_t busy;
+
+        if (opt_probe_timeout == 0 || probe_agent(fd)) {
+            close(fd);
+            return 1;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+            (busy = agent_busy_ms(cred.pid)) > 0 && busy < BUSY_STUCK_MS) {
+            warnx("agent pid %d at %s has been busy with a request for %.1f s, reusing it",
+                  cred.pid, sockpath, busy / 1000.0);
+            close(fd);
+            return 1;
+        }
+        if (!replace_stuck_agent(fd, sockpath, pidpath)) {
+            close(fd);
+            return 1;  // keep the old behaviour rather than fight over the path
+        }
         close(fd);
-        return 1;
+        // Now the path is either stale or taken over by a fresh agent
+        return reuse_socket_path(sockpath, pidpath);
     }
     else if (errno == ENOENT) {
         close(fd);
         debug_print("reuse_socket_path: socket %s not present", sockpath);
         return 0;
     }
+    else if (errno == ECONNREFUSED && sockpath[0] == '@') {
+        // Abstract names simply do not exist when nobody is listening
+        close(fd);
+        debug_print("reuse_socket_path: socket %s not present", sockpath);
+        return 0;
+    }
     else if (errno == ECONNREFUSED) {
         // Either it's not listening, or not a socket at all.  If it was at
         // least a socket, remove it so it can be replaced.
@@ -281,6 +961,81 @@ reuse_socket_path(const char* sockpath)
 }
 
 
+// Create (or verify) the per-user directory holding the --shared socket, its
+// pid file and the startup lock. It must not be accessible to anybody else.
+static void
+prepare_shared_dir(char *dir, size_t len)
+{
+    struct stat st;
+    const char *runtime_dir = get_runtime_dir();
+    int n;
+
+    if (runtime_dir)
+        n = snprintf(dir, len, "%s/ssh-agent-wsl", runtime_dir);
+    else
+        n = snprintf(dir, len, "/tmp/ssh-agent-wsl-%d", (int)getuid());
+    if (n < 0 || (size_t)n >= len)
+        errx(1, "shared directory path is too long");
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST)
+        err(1, "mkdir(%s)", dir);
+
+    if (lstat(dir, &st) < 0)
+        err(1, "stat(%s)", dir);
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & (S_IRWXG | S_IRWXO)))
+        errx(1, "%s must be a directory owned by the current user and not accessible to others", dir);
+}
+
+
+// Take the startup lock in the shared directory. The lock goes away with the
+// returned descriptor, so a crashed starter never blocks the next one.
+static int
+lock_shared_dir(const char *dir)
+{
+    char lockpath[PATH_MAX];
+    int fd;
+
+    if (snprintf(lockpath, sizeof(lockpath), "%s/agent.lock", dir) >= (int)sizeof(lockpath))
+        errx(1, "shared directory path %s is too long", dir);
+    fd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        cleanup_warn("open lock");
+
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR)
+            cleanup_warn("flock");
+    }
+    debug_print("took startup lock %s", lockpath);
+    return fd;
+}
+
+
+// Write the pid file next to the shared socket, replacing it atomically so
+// that readers never see a partial one.
+static void
+write_pid_file(const char *path, pid_t pid)
+{
+    char tmppath[PATH_MAX + 8];
+    char buf[16];
+    int fd, len;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        warn("open(%s)", tmppath);
+        return;
+    }
+    len = snprintf(buf, sizeof(buf), "%d\n", pid);
+    if (write(fd, buf, (size_t)len) != len || rename(tmppath, path) < 0) {
+        warn("write pid file %s", path);
+        unlink(tmppath);
+    }
+    close(fd);
+}
+
+
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 static int
 start_win32_helper()
 {
@@ -307,6 +1062,14 @@ start_win32_helper()
     win32_in = in_pipe[0];  // our input, helper's output
     win32_out = out_pipe[1];  // our output, helper's input
 
+    // Make room for a whole message each way, so that neither side blocks
+    // halfway through one
+    if (fcntl(win32_out, F_SETPIPE_SZ, AGENT_MAX_MSGLEN) < 0 || fcntl(win32_in, F_SETPIPE_SZ, AGENT_MAX_MSGLEN) < 0)
+        debug_print("could not resize helper pipes (%d)", errno);
+    int pipe_size = fcntl(win32_out, F_GETPIPE_SZ);
+    if (pipe_size > 0)
+        win32_pipe_size = (size_t)pipe_size;
+
     posix_spawn_file_actions_init(&action);
 
     // Set up stdin/stdout. The original files will be closed at exec.
@@ -315,7 +1078,9 @@ start_win32_helper()
 
     // Change to (hopefully) a DrvFs filesystem. Otherwise a warning about changing
     // the directory may be shown. In the future, this should check /proc/mounts for
-    // a DrvFs path instead of assuming the C: drive is present.
+    // a DrvFs path instead of assuming the C: drive is present. The directory is
+    // per process, keep other worker threads from changing it meanwhile.
+    pthread_mutex_lock(&spawn_lock);
     if ((cwd = get_current_dir_name()) != NULL) {
         if (chdir("/mnt/c") < 0)
             debug_print("could not chdir to DrvFs (%d)\n", errno);
@@ -328,6 +1093,7 @@ start_win32_helper()
         cleanup_win32(0);
         result = -1;
     }
+    __atomic_store_n(&win32_start_failed, result != 0, __ATOMIC_RELAXED);
 
     // Restore the original working directory. It would be nice if spawn() supported
     // this directly.
@@ -336,6 +1102,7 @@ start_win32_helper()
             warn("failed to restore cwd");
         free(cwd);
     }
+    pthread_mutex_unlock(&spawn_lock);
 
     // Close the files passed to the child.
     close(in_pipe[1]);
@@ -365,22 +1132,202 @@ start_win32_helper()
 }
 
 
+// Time for the relay of --relay to start listening
+#define RELAY_START_MS 3000
+
+// Start the relay for --relay and wait until it listens. It is started in the
+// directory of its socket, which is on DrvFs, and finds the socket there by
+// name. It serves every daemon of the user, in a session of its own, and is
+// left running when this one exits.
 static int
-agent_query(void *buf)
+start_win32_relay(const char *path)
 {
-    if (start_win32_helper() != 0)
-        return -1;
-
-    // Subprocess has been started (though it may still fail, but at least the spawn finished)
+    posix_spawn_file_actions_t action;
+    posix_spawnattr_t attr;
+    struct sockaddr_un addr;
+    socklen_t addrlen = socket_address(path, &addr);
+    char dir[PATH_MAX], child_arg[9], *name;
+    char *argv[] = { win32_helper_path, child_arg, "--relay", NULL, NULL };
+    char *cwd;
+    pid_t pid;
+    int result = 0;
 
-    size_t rem = msglen(buf);
-    ssize_t cnt;
-    void *bufp = buf;
-    int first_done = 0;
+    snprintf(dir, sizeof(dir), "%s", path);
+    name = strrchr(dir, '/');  // --relay takes absolute paths only
+    *name++ = '\0';
+    argv[3] = name;
+    snprintf(child_arg, 9, "%08d", opt_debug ? WSLP_CHILD_FLAG_DEBUG : 0);
+
+    pthread_mutex_lock(&spawn_lock);
+    if (win32_relay_pid > 0 && waitpid(win32_relay_pid, NULL, WNOHANG) == 0) {
+        // Started before and still running, give it more time
+        pthread_mutex_unlock(&spawn_lock);
+        goto wait;
+    }
+    win32_relay_pid = 0;
 
-    while (rem > 0) {
-        cnt = write(win32_out, bufp, rem);
+    posix_spawn_file_actions_init(&action);
+    posix_spawn_file_actions_addopen(&action, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&action, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+
+    debug_print("starting win32 relay for %s", path);
+    if ((cwd = get_current_dir_name()) == NULL || chdir(dir[0] ? dir : "/") < 0) {
+        warn("cannot change to the directory of relay socket %s", path);
+        result = -1;
+    }
+    else if (posix_spawn(&pid, win32_helper_path, &action, &attr, argv, environ) != 0) {
+        warn("failed to start win32 relay %s", win32_helper_path);
+        result = -1;
+    }
+    else
+        win32_relay_pid = pid;
+    if (cwd != NULL) {
+        if (chdir(cwd) < 0)
+            warn("failed to restore cwd");
+        free(cwd);
+    }
+    pthread_mutex_unlock(&spawn_lock);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&action);
+    if (result != 0)
+        return result;
+
+wait:
+    for (int waited = 0; waited < RELAY_START_MS; waited += 50) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+            break;
+        result = connect(fd, (struct sockaddr *)&addr, addrlen);
+        close(fd);
+        if (result == 0)
+            return 0;
+        usleep(50000);
+    }
+    warnx("win32 relay did not listen on %s within %d ms", path, RELAY_START_MS);
+    return -1;
+}
+
+
+// Ask an idle helper to exit by closing its input, it is started again by the
+// next query. Its exit is reaped by the SIGCHLD handler.
+static void
+stop_win32_helper()
+{
+    if (win32_pid <= 0)
+        return;
+    if (win32_retired_pid > 0)
+        waitpid(win32_retired_pid, NULL, 0);  // only keep track of one
+    debug_print("stopping idle win32 helper %d", win32_pid);
+    win32_retired_pid = win32_pid;
+    win32_pid = 0;
+    cleanup_win32(0);
+}
+
+
+#if HAVE_IO_URING
+static struct uring *
+get_ring()
+{
+    if (ring == NULL && !ring_failed) {
+        if ((ring = malloc(sizeof(*ring))) == NULL || uring_init(ring, RING_ENTRIES) != 0) {
+            // WSL 1 and locked down kernels don't have it
+            debug_print("io_uring not available (%d), using plain syscalls", errno);
+            free(ring);
+            ring = NULL;
+            ring_failed = 1;
+        }
+    }
+    return ring;
+}
+
+
+// Submit what is queued on the ring and wait for n completions. The result of
+// each, which is the byte count or -errno, is stored in res by user_data.
+static void
+ring_complete(struct uring *r, unsigned n, ssize_t *res)
+{
+    struct io_uring_cqe *cqe;
+
+    if (uring_submit_wait(r, n) < 0)
+        cleanup_warn("io_uring_enter");
+    while (n > 0) {
+        // Waiting can end early on a signal
+        if ((cqe = uring_peek_cqe(r)) == NULL) {
+            if (uring_submit_wait(r, 1) < 0)
+                cleanup_warn("io_uring_enter");
+            continue;
+        }
+        res[cqe->user_data] = cqe->res;
+        uring_cqe_seen(r);
+        --n;
+    }
+}
+
+
+// Write a request to the helper and read its reply with one io_uring_enter()
+// instead of a write() and two read()s. The read is linked to the write and
+// asks for a whole message, which the helper sends in one piece. Sets
+// *written and returns the number of bytes read, agent_query() carries on
+// from there if the ring was not available or either came up short.
+static size_t
+ring_query(void *buf, size_t *written)
+{
+    struct uring *r = get_ring();
+    struct io_uring_sqe *sqe;
+    ssize_t res[2];
+
+    *written = 0;
+    if (r == NULL)
+        return 0;
+
+    // The ring is always empty between queries, there is room for both
+    sqe = uring_get_sqe(r);
+    uring_prep_rw(sqe, IORING_OP_WRITE, win32_out, buf, msglen(buf), 0);
+    sqe->flags |= IOSQE_IO_LINK;  // a failed or short write cancels the read
+    sqe = uring_get_sqe(r);
+    uring_prep_rw(sqe, IORING_OP_READ, win32_in, buf, AGENT_MAX_MSGLEN, 1);
+    ring_complete(r, 2, res);
+
+    if (res[0] > 0)
+        *written = (size_t)res[0];
+    return res[1] > 0 ? (size_t)res[1] : 0;
+}
+#endif
+
+
+// Give up on a helper which returns a reply of an impossible size.
+static int
+reply_too_long(const uint8_t *buf)
+{
+    warnx("win32 helper tried to return %u bytes; aborting", msglen(buf) - 4);
+    cleanup_win32(1);
+    return -1;
+}
+
+
+// Write iovcnt buffers to the helper in as few writev() calls as it takes. If
+// retry is set and it turns out to have exited since the last query, it is
+// restarted once.
+static int
+helper_writev(struct iovec *iov, int iovcnt, int retry)
+{
+    ssize_t cnt = 0;
+
+    while (1) {
+        // Skip what has been written
+        for (; iovcnt > 0 && (size_t)cnt >= iov->iov_len; ++iov, --iovcnt)
+            cnt -= (ssize_t)iov->iov_len;
+        if (iovcnt <= 0)
+            return 0;
+        iov->iov_base = (uint8_t *)iov->iov_base + cnt;
+        iov->iov_len -= (size_t)cnt;
+
+        cnt = writev(win32_out, iov, iovcnt);
         if (cnt < 0) {
+            cnt = 0;
             switch (errno) {
             case EINTR:
                 if (win32_out < 0)
@@ -390,11 +1337,11 @@ agent_query(void *buf)
             case EPIPE:
                 // The helper has closed its input; try to restart
                 cleanup_win32(1);
-                if (!first_done) {
+                if (retry) {
                     warn("win32 helper had exited; trying to restart");
                     if (start_win32_helper() != 0)
                         return -1;
-                    first_done = 1;  // not actually done, but don't retry infinitely
+                    retry = 0;  // don't retry infinitely
                     continue;
                 }
                 warn("win32 helper exited during query (write); aborting");
@@ -408,16 +1355,82 @@ agent_query(void *buf)
         }
 
         // Write succeeded
-        first_done = 1;
-        rem -= (size_t) cnt;
-        bufp += cnt;
+        retry = 0;
     }
+}
 
-    first_done = 0;
-    rem = 4; // start with 4-byte length
-    bufp = buf;
-    while (rem > 0) {
-        cnt = read(win32_in, bufp, rem);
+
+static int
+helper_write(const void *buf, size_t len, int retry)
+{
+    struct iovec iov = { (void *)buf, len };
+    return helper_writev(&iov, 1, retry);
+}
+
+
+// Read the replies to n requests into bufs, in order, got bytes of the first
+// being in place already. Each read() takes as much as the pipe holds rather
+// than a header and then a body; whatever comes after the end of one reply
+// is the start of the next.
+static int
+helper_read_replies(uint8_t *const *bufs, int n, size_t got)
+{
+    ssize_t cnt;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        uint8_t *buf = bufs[i];
+        int64_t size;
+        size_t extra;
+
+        while ((size = frame_check(buf, got, AGENT_MAX_MSGLEN)) <= 0) {
+            if (size == FRAME_TOO_LONG)
+                return reply_too_long(buf);
+            cnt = read(win32_in, buf + got, AGENT_MAX_MSGLEN - got);
+            if (cnt < 0) {
+                switch (errno) {
+                case EINTR:
+                    if (win32_in < 0)
+                        return -1;  // helper had died and signal handler cleaned up
+                    continue;
+
+                default:
+                    cleanup_warn("agent_query read");
+                    break;
+                }
+            }
+            else if (cnt == 0) {
+                // End of file on pipe, the helper went away
+                warn("win32 helper exited during query (read, reply %d of %d); aborting", i + 1, n);
+                cleanup_win32(1);
+                return -1;
+            }
+            got += (size_t) cnt;
+        }
+
+        extra = got - (size_t)size;
+        if (extra > 0 && i + 1 == n) {
+            warnx("win32 helper returned %zu bytes after the reply; aborting", extra);
+            cleanup_win32(1);
+            return -1;
+        }
+        if (extra > 0)
+            memcpy(bufs[i + 1], buf + size, extra);
+        got = extra;
+    }
+    return 0;
+}
+
+
+// Read exactly len bytes from the helper.
+static int
+helper_read(void *buf, size_t len)
+{
+    uint8_t *bufp = buf;
+    ssize_t cnt;
+
+    while (len > 0) {
+        cnt = read(win32_in, bufp, len);
         if (cnt < 0) {
             switch (errno) {
             case EINTR:
@@ -432,144 +1445,1855 @@ agent_query(void *buf)
         }
         else if (cnt == 0) {
             // End of file on pipe, the helper went away
-            warn("win32 helper exited during query (read, rem=%llu); aborting", rem);
+            warn("win32 helper exited during query (read, rem=%zu); aborting", len);
             cleanup_win32(1);
             return -1;
         }
 
-        rem -= (size_t) cnt;
+        len -= (size_t) cnt;
         bufp += cnt;
+    }
+    return 0;
+}
+
+
+static int
+win32_submit(struct backend *b, uint8_t *const *bufs, int n)
+{
+    struct iovec iov[MAX_BATCH];
+    size_t written = 0;
+    int i;
+
+    (void)b;
+
+    win32_last_used = monotonic_ms();
+    if (start_win32_helper() != 0)
+        return -1;
+
+    // Subprocess has been started (though it may still fail, but at least the spawn finished)
+
+    for (i = 0; i < n; ++i) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = msglen(bufs[i]);
+    }
+
+    win32_reply_got = 0;
+#if HAVE_IO_URING
+    if (opt_io_uring && n == 1) {
+        win32_reply_got = ring_query(bufs[0], &written);
+        if (win32_in < 0)
+            return -1;  // helper had died and signal handler cleaned up
+    }
+#endif
+
+    // The reply may have overwritten the request already, iov has its length
+    iov[0].iov_base = bufs[0] + written;
+    iov[0].iov_len -= written;
+    return helper_writev(iov, n, written == 0);
+}
+
+
+static int
+win32_complete(struct backend *b, uint8_t *const *bufs, int n)
+{
+    (void)b;
+    // Part or all of the reply may have come with the write
+    return helper_read_replies(bufs, n, win32_reply_got);
+}
+
+
+static void
+win32_start(struct backend *b)
+{
+    (void)b;
+    if (win32_pid <= 0) {
+        win32_last_used = monotonic_ms();
+        start_win32_helper();
+    }
+}
+
+
+static void
+win32_release_idle(struct backend *b, int64_t idle_ms)
+{
+    (void)b;
+    if (win32_pid > 0 && monotonic_ms() - win32_last_used >= idle_ms)
+        stop_win32_helper();
+    // Without a SIGCHLD handler (debug mode) nobody else reaps it
+    if (win32_retired_pid > 0 && waitpid(win32_retired_pid, NULL, WNOHANG) != 0)
+        win32_retired_pid = 0;
+}
+
+
+static int
+win32_healthy(struct backend *b)
+{
+    (void)b;
+    return !__atomic_load_n(&win32_start_failed, __ATOMIC_RELAXED);
+}
+
+
+static struct backend win32_backend = {
+    "win32 helper",
+    win32_submit,
+    win32_complete,
+    win32_start,
+    win32_release_idle,
+    win32_healthy,
+};
+
+
+// Pass n requests to a backend and wait for their replies, which replace
+// them in bufs.
+static int
+backend_query(struct backend *b, uint8_t *const *bufs, int n)
+{
+    if (b->submit(b, bufs, n) != 0)
+        return -1;
+    return b->complete(b, bufs, n);
+}
+
+
+// Serve a request with --splice. The part of it still in the socket goes to
+// the helper with splice(), and so does a large reply on its way back, so
+// neither passes through p->buf: only what had been received already and the
+// reply header are copied. The part of a reply the socket can't take at once
+// is read into p->buf after all, and sent from there.
+static int
+agent_relay(struct fd_buf *p)
+{
+    size_t rem = p->splice_in;
+    ssize_t cnt;
+
+    win32_last_used = monotonic_ms();
+    p->splice_in = 0;
+    if (start_win32_helper() != 0)
+        return -1;
 
-        if (!first_done) {
-            // Waiting for body size, see if we have it
-            if (rem != 0)
-                continue;  // nope
+    if (helper_write(p->buf, (size_t)p->recv, 1) != 0)
+        return -1;
+    while (rem > 0) {
+        cnt = splice(p->fd, NULL, win32_out, NULL, rem, SPLICE_F_MOVE);
+        if (cnt < 0 && errno == EINTR && win32_out >= 0)
+            continue;
+        if (cnt <= 0) {
+            // The helper has part of a request, it can only start over
+            warn("splice to win32 helper");
+            cleanup_win32(1);
+            return -1;
+        }
+        rem -= (size_t) cnt;
+    }
 
-            rem = msglen(buf) - 4;  // yep, reset remaining to body size
-            if (rem > (AGENT_MAX_MSGLEN - 4)) {  // dummy size
-                warn("win32 helper tried to return %llu bytes; aborting", rem);
+    if (helper_read(p->buf, 4) != 0)
+        return -1;
+    if (frame_check(p->buf, 4, AGENT_MAX_MSGLEN) == FRAME_TOO_LONG)
+        return reply_too_long(p->buf);
+    rem = msglen(p->buf) - 4;
+    p->send = 0;
+    if (rem >= SPLICE_MIN && (cnt = send(p->fd, p->buf, 4, MSG_DONTWAIT)) > 0)
+        p->send = cnt;
+    // Only once the header is out, or it would come after part of the body
+    if (p->send == 4) {
+        while (rem > 0) {
+            cnt = splice(win32_in, NULL, p->fd, NULL, rem, SPLICE_F_MOVE);
+            if (cnt < 0 && errno == EINTR && win32_in >= 0)
+                continue;
+            if (cnt == 0) {
+                warnx("win32 helper exited during query (splice, rem=%zu); aborting", rem);
                 cleanup_win32(1);
                 return -1;
             }
-            first_done = 1;
+            if (cnt < 0)
+                break;  // the socket is full (or gone), copy the rest
+            rem -= (size_t) cnt;
+            p->send += cnt;
+        }
+    }
+    return helper_read(p->buf + msglen(p->buf) - rem, rem);
+}
+
+
+static time_t
+monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+static void
+set_failure(uint8_t *buf)
+{
+    static const uint8_t reply_error[5] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+    memcpy(buf, reply_error, sizeof(reply_error));
+}
+
+
+static pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+id_snapshot_free(struct id_snapshot *snap)
+{
+    int i;
+
+    if (!snap)
+        return;
+    free(snap->answer);
+    for (i = 0; i < MAX_LISTENERS; ++i)
+        free(snap->view_answer[i]);
+    key_index_free(&snap->owners);
+    free(snap);
+}
+
+
+// Take a reference to the current snapshot, NULL if there is none. It stays
+// valid until id_snapshot_put().
+static struct id_snapshot *
+id_cache_get()
+{
+    struct id_snapshot *snap;
+
+    pthread_mutex_lock(&id_cache_lock);
+    if ((snap = id_cache) != NULL)
+        __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&id_cache_lock);
+    return snap;
+}
+
+
+static void
+id_snapshot_put(struct id_snapshot *snap)
+{
+    if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        id_snapshot_free(snap);
+}
+
+
+// Make snap, with the reference it holds for the cache, the current snapshot
+static void
+id_cache_publish(struct id_snapshot *snap)
+{
+    struct id_snapshot *old;
+
+    pthread_mutex_lock(&id_cache_lock);
+    if (snap)
+        snap->generation = ++id_cache_generation;
+    old = id_cache;
+    id_cache = snap;
+    pthread_mutex_unlock(&id_cache_lock);
+    id_snapshot_put(old);
+}
+
+
+// Remember a fresh identities answer and rebuild the views of all listeners
+// from it, so that serving a restricted socket is a plain copy. The snapshot
+// takes over owners, which is the index of a merged answer. Returns a
+// reference to it for the caller.
+static struct id_snapshot *
+id_cache_store(const uint8_t *answer, struct key_index *owners)
+{
+    size_t len = msglen(answer);
+    struct id_snapshot *snap = calloc(1, sizeof(*snap));
+    int i;
+
+    if (!snap || (snap->answer = malloc(len)) == NULL) {
+        warnx("id_cache_store: No memory");
+        key_index_free(owners);
+        free(snap);
+        return NULL;
+    }
+    memcpy(snap->answer, answer, len);
+    snap->owners = *owners;
+    owners->slots = NULL;
+    snap->fetched = monotonic_now();
+    snap->refs = 2;
+
+    for (i = 0; i < nlisteners; ++i) {
+        struct key_view *view = listeners[i].view;
+        uint8_t *filtered;
+
+        if (!view)
+            continue;
+        if ((filtered = malloc(len)) == NULL || key_view_filter(view, answer, filtered, len) == 0) {
+            free(filtered);
+            filtered = NULL;
         }
+        snap->view_answer[i] = filtered;
     }
+    id_cache_publish(snap);
+    return snap;
+}
+
+
+static void
+id_cache_invalidate()
+{
+    id_cache_publish(NULL);
+}
+
 
+// Pass the request in buf to every backend at once, so that it takes as long
+// as the slowest of them rather than all of them together. submitted[i] says
+// whether backend i took it. Returns -1 if there is no memory.
+static int
+fanout_submit(const uint8_t *buf, int *submitted)
+{
+    int i;
+
+    for (i = 0; i < nbackends; ++i) {
+        if (!fanout_bufs[i] && (fanout_bufs[i] = malloc(AGENT_MAX_MSGLEN)) == NULL) {
+            warnx("fanout_submit: No memory");
+            return -1;
+        }
+    }
+    for (i = 0; i < nbackends; ++i) {
+        memcpy(fanout_bufs[i], buf, msglen(buf));
+        submitted[i] = backends[i]->submit(backends[i], &fanout_bufs[i], 1) == 0;
+    }
     return 0;
 }
 
 
+// Read back the replies to fanout_submit(): answers[i] is the reply of
+// backend i, or NULL if it failed. Returns the number of replies.
 static int
-agent_recv(int fd, struct fd_buf *p)
+fanout_complete(const int *submitted, const uint8_t **answers)
 {
-    ssize_t len = recv(fd, p->buf + p->recv, sizeof(p->buf) - (size_t)p->recv, 0);
-    if (len <= 0) {
-        if (len < 0)
-            warn("recv(%d)", fd);
-        return -1;
+    int i, nanswers = 0;
+
+    for (i = 0; i < nbackends; ++i) {
+        answers[i] = NULL;
+        if (submitted[i] && backends[i]->complete(backends[i], &fanout_bufs[i], 1) == 0) {
+            answers[i] = fanout_bufs[i];
+            ++nanswers;
+        }
     }
+    return nanswers;
+}
 
-    p->recv += len;
-    if (p->recv < 4 || p->recv < msglen(p->buf))
-        return 0;  // more to recv
 
-    if (p->recv > msglen(p->buf)) {
-        warnx("recv(%d) = %d (expected %d)",
-              fd, p->recv, msglen(p->buf));
+static int
+fanout_query(const uint8_t *buf, const uint8_t **answers)
+{
+    int submitted[MAX_BACKENDS];
+
+    if (fanout_submit(buf, submitted) != 0)
+        return 0;
+    return fanout_complete(submitted, answers);
+}
+
+
+// Merge the identities answers of the backends into buf. A backend which
+// failed is left out, the keys of the others are still good.
+static int
+merge_answers(const uint8_t **answers, int nanswers, uint8_t *buf, struct key_index *owners)
+{
+    int i;
+
+    debug_print("identities from %d of %d backends", nanswers, nbackends);
+    if (nanswers == 0)
         return -1;
+
+    for (i = 0; i < nbackends; ++i) {
+        if (answers[i] && msglen(answers[i]) >= 5 && answers[i][4] == SSH_AGENT_IDENTITIES_ANSWER)
+            break;
+    }
+    if (i == nbackends || nbackends == 1) {
+        // Nothing to merge, or nobody had identities to give (all locked,
+        // say): pass the first answer on as it is
+        for (i = 0; !answers[i]; ++i)
+            ;
+        memcpy(buf, answers[i], msglen(answers[i]));
+    }
+    else if (identities_merge(answers, nbackends, buf, AGENT_MAX_MSGLEN, owners) == 0) {
+        warnx("merged identities do not fit in a message");
+        set_failure(buf);
+    }
+    return 0;
+}
+
+
+static int
+merge_identities(uint8_t *buf, struct key_index *owners)
+{
+    const uint8_t *answers[MAX_BACKENDS];
+    int nanswers = fanout_query(buf, answers);
+
+    return merge_answers(answers, nanswers, buf, owners);
+}
+
+
+// Removing all keys, locking and unlocking concern every backend. The reply
+// is a success only if all of them succeeded: ssh-add then knows that some
+// keys may still be there, or usable.
+static int
+broadcast_request(uint8_t *buf)
+{
+    const uint8_t *answers[MAX_BACKENDS];
+    int i, ok = 1, nanswers = fanout_query(buf, answers);
+
+    debug_print("request %d answered by %d of %d backends", buf[4], nanswers, nbackends);
+    if (nanswers == 0)
+        return -1;
+
+    for (i = 0; i < nbackends; ++i)
+        ok &= answers[i] && msglen(answers[i]) >= 5 && answers[i][4] == SSH_AGENT_SUCCESS;
+    if (ok) {
+        static const uint8_t success[5] = { 0, 0, 0, 1, SSH_AGENT_SUCCESS };
+        memcpy(buf, success, sizeof(success));
+    }
+    else
+        set_failure(buf);
+    return 0;
+}
+
+
+static int
+broadcast_type(uint8_t type)
+{
+    return type == SSH_AGENTC_REMOVE_ALL_IDENTITIES || type == SSH_AGENTC_LOCK || type == SSH_AGENTC_UNLOCK;
+}
+
+
+static int
+query_identities(uint8_t *buf, struct key_index *owners)
+{
+    if (nbackends == 1)
+        return backend_query(backends[0], &buf, 1);
+    return merge_identities(buf, owners);
+}
+
+
+// With --prefetch, the identities are asked for as soon as a client connects,
+// since nearly every client starts by listing them, unless the cache has a
+// current answer. The answer is read back before any other request is served,
+// so that the helper never has more than one request to answer, and is used
+// for the first listing of each client which connected meanwhile.
+static __thread int prefetch_pending = 0;
+static __thread int prefetch_submitted[MAX_BACKENDS];
+static __thread uint64_t prefetch_generation = 0;  // snapshot of the last prefetch
+static __thread uint8_t *prefetch_buf = NULL;  // for merging the answers, kept for the thread
+
+
+static void
+prefetch_start(struct fd_buf *p)
+{
+    static const uint8_t request[5] = { 0, 0, 0, 1, SSH_AGENTC_REQUEST_IDENTITIES };
+    struct id_snapshot *snap;
+    int current;
+
+    if (prefetch_pending) {
+        p->prefetched = 1;
+        return;
+    }
+    snap = id_cache_get();
+    current = snap && opt_cache_ttl > 0 && monotonic_now() - snap->fetched < opt_cache_ttl;
+    id_snapshot_put(snap);
+    if (current)
+        return;
+    // Allocated before anything is sent, so that every reply is read back
+    if (!prefetch_buf && (prefetch_buf = malloc(AGENT_MAX_MSGLEN)) == NULL) {
+        warnx("prefetch_start: No memory");
+        return;
+    }
+    if (fanout_submit(request, prefetch_submitted) != 0)
+        return;
+    debug_print("prefetching identities");
+    prefetch_pending = p->prefetched = 1;
+}
+
+
+static void
+prefetch_finish()
+{
+    const uint8_t *answers[MAX_BACKENDS];
+    struct key_index owners = { 0, NULL };
+    uint8_t *buf = prefetch_buf;
+    int nanswers;
+
+    if (!prefetch_pending)
+        return;
+    prefetch_pending = 0;
+    nanswers = fanout_complete(prefetch_submitted, answers);
+    if (merge_answers(answers, nanswers, buf, &owners) == 0 && buf[4] == SSH_AGENT_IDENTITIES_ANSWER) {
+        struct id_snapshot *snap = id_cache_store(buf, &owners);
+
+        if (snap) {
+            prefetch_generation = snap->generation;
+            id_snapshot_put(snap);
+        }
+    }
+    key_index_free(&owners);
+}
+
+
+// Requests naming a key (signing, removing it) go to the backend which listed
+// the key, found in the index of the last identities answer. Without a current
+// answer, one is fetched first. Keys the local store takes are added there,
+// everything else goes to the default backend.
+static struct backend *
+request_backend(const uint8_t *msg)
+{
+    struct id_snapshot *snap;
+    struct key_index owners = { 0, NULL };
+    const uint8_t *blob;
+    uint32_t len;
+    int owner = -1;
+
+#if HAVE_OPENSSL
+    if (local_backend && keystore_accepts(msg))
+        return local_backend;
+#endif
+    if (nbackends == 1 || agent_request_key(msg, &blob, &len) != 0)
+        return backends[default_backend];
+
+    if ((snap = id_cache_get()) == NULL) {
+        static const uint8_t request[5] = { 0, 0, 0, 1, SSH_AGENTC_REQUEST_IDENTITIES };
+        uint8_t *buf = malloc(AGENT_MAX_MSGLEN);
+
+        if (buf) {
+            memcpy(buf, request, sizeof(request));
+            if (merge_identities(buf, &owners) == 0 && buf[4] == SSH_AGENT_IDENTITIES_ANSWER)
+                snap = id_cache_store(buf, &owners);
+            key_index_free(&owners);
+            free(buf);
+        }
+    }
+    if (snap)
+        owner = key_index_find(&snap->owners, snap->answer, blob, len);
+    id_snapshot_put(snap);
+    return owner >= 0 ? backends[owner] : backends[default_backend];
+}
+
+
+static void
+backends_start()
+{
+    int i;
+
+    for (i = 0; i < nbackends; ++i)
+        backends[i]->start(backends[i]);
+}
+
+
+static int
+agent_query(uint8_t *buf)
+{
+    if (nbackends > 1 && broadcast_type(buf[4]))
+        return broadcast_request(buf);
+    return backend_query(request_backend(buf), &buf, 1);
+}
+
+
+static int
+agent_list_identities(struct fd_buf *p)
+{
+    struct key_view *view = p->listener->view;
+    struct id_snapshot *snap = id_cache_get();
+    int prefetched = p->prefetched;
+
+    p->prefetched = 0;
+    if (prefetched && snap && snap->generation == prefetch_generation) {
+        debug_print("identities answer prefetched");
+        memcpy(p->buf, snap->answer, msglen(snap->answer));
+    }
+    else if (snap && opt_cache_ttl > 0 && monotonic_now() - snap->fetched < opt_cache_ttl) {
+        debug_print("identities answer from cache");
+        memcpy(p->buf, snap->answer, msglen(snap->answer));
+    }
+    else {
+        struct key_index owners = { 0, NULL };
+
+        id_snapshot_put(snap);
+        if (query_identities(p->buf, &owners) != 0)
+            return -1;
+        if (msglen(p->buf) < 5 || p->buf[4] != SSH_AGENT_IDENTITIES_ANSWER) {
+            key_index_free(&owners);
+            return 0;  // pass the failure on as is
+        }
+        snap = id_cache_store(p->buf, &owners);
+    }
+
+    if (view) {
+        uint8_t *answer = snap ? snap->view_answer[p->listener - listeners] : NULL;
+        if (answer)
+            memcpy(p->buf, answer, msglen(answer));
+        else
+            set_failure(p->buf);
+    }
+    id_snapshot_put(snap);
+    return 0;
+}
+
+
+// Only listing, signing with the keys in the view and extensions (which
+// carry session binding) are allowed on restricted sockets.
+static int
+view_allows(const struct key_view *view, const uint8_t *msg)
+{
+    const uint8_t *blob;
+    uint32_t len;
+
+    switch (msg[4]) {
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+    case SSH_AGENTC_EXTENSION:
+        return 1;
+    case SSH_AGENTC_SIGN_REQUEST:
+        return agent_sign_request_key(msg, &blob, &len) == 0 && key_view_contains(view, blob, len);
+    default:
+        return 0;
+    }
+}
+
+
+// Serve the complete request in p->buf, leaving the reply in its place.
+static int
+agent_request(struct fd_buf *p)
+{
+    struct key_view *view = p->listener->view;
+    uint8_t type;
+
+    if (msglen(p->buf) < 5) {
+        set_failure(p->buf);
+        return 0;
+    }
+    type = p->buf[4];
+    prefetch_finish();
+
+    if (view && !view_allows(view, p->buf)) {
+        debug_print("request %d refused by view %s", type, view->path);
+        set_failure(p->buf);
+        return 0;
+    }
+
+    // The cache needs the identities answer in memory
+    if (opt_splice && !view && (type != SSH_AGENTC_REQUEST_IDENTITIES || (opt_cache_ttl == 0 && !opt_prefetch))) {
+        if (agent_relay(p) != 0)
+            return -1;
+    }
+    else if (type == SSH_AGENTC_REQUEST_IDENTITIES)
+        return agent_list_identities(p);
+    else if (agent_query(p->buf) != 0)
+        return -1;
+    if (type != SSH_AGENTC_SIGN_REQUEST && type != SSH_AGENTC_EXTENSION)
+        id_cache_invalidate();
+    return 0;
+}
+
+
+// Requests which agent_request() would pass to agent_query() as they are can
+// share a gathered write to the helper with others.
+static int
+batchable(const struct fd_buf *p)
+{
+    struct key_view *view = p->listener->view;
+
+    if (msglen(p->buf) < 5 || p->buf[4] == SSH_AGENTC_REQUEST_IDENTITIES)
+        return 0;
+    if (nbackends > 1 && broadcast_type(p->buf[4]))
+        return 0;
+    if (view)
+        return view_allows(view, p->buf);
+    return !opt_splice;
+}
+
+
+// Pass a batch of requests to the backends at once (the helper gets its share
+// in one writev()) and read back the replies, which each backend returns in
+// the same order.
+static int
+agent_query_batch(struct fd_buf **batch, int n)
+{
+    struct backend *owner[MAX_BATCH];
+    uint8_t *bufs[MAX_BATCH];  // grouped by backend
+    int count[MAX_BACKENDS] = { 0 };
+    int i, k, m, submitted, res = 0, invalidate = 0;
+
+    prefetch_finish();
+    for (i = 0; i < n; ++i) {
+        owner[i] = request_backend(batch[i]->buf);
+        if (batch[i]->buf[4] != SSH_AGENTC_SIGN_REQUEST && batch[i]->buf[4] != SSH_AGENTC_EXTENSION)
+            invalidate = 1;
+    }
+    for (k = 0, m = 0; k < nbackends; ++k) {
+        for (i = 0; i < n; ++i) {
+            if (owner[i] == backends[k])
+                bufs[m + count[k]++] = batch[i]->buf;
+        }
+        m += count[k];
+    }
+
+    // All backends get their requests before any reply is waited for
+    for (submitted = 0, m = 0; submitted < nbackends; m += count[submitted++]) {
+        if (count[submitted] == 0)
+            continue;
+        debug_print("passing %d requests to the %s at once", count[submitted], backends[submitted]->name);
+        if (backends[submitted]->submit(backends[submitted], bufs + m, count[submitted]) != 0) {
+            res = -1;
+            break;
+        }
+    }
+    // Those which got them must be read, even if another backend failed
+    for (k = 0, m = 0; k < submitted; m += count[k++]) {
+        if (count[k] > 0 && backends[k]->complete(backends[k], bufs + m, count[k]) != 0)
+            res = -1;
+    }
+    if (res != 0)
+        return -1;
+    if (invalidate)
+        id_cache_invalidate();
+    return 0;
+}
+
+
+// With --splice, the first recv() of a message only takes what is worth
+// copying, leaving the rest of a large one in the socket.
+static size_t
+recv_room(const struct fd_buf *p)
+{
+    if (opt_splice && p->recv == 0)
+        return SPLICE_MIN;
+    return sizeof(p->buf) - (size_t)p->recv;
+}
+
+
+// Leave the rest of a large request in the socket for agent_relay(), if it
+// has all arrived. Otherwise a slow client could keep the helper waiting.
+static int
+splice_request(int fd, struct fd_buf *p)
+{
+    size_t rem = msglen(p->buf) - (size_t)p->recv;
+    int avail;
+
+    if (!opt_splice || p->listener->view || rem < SPLICE_MIN)
+        return 0;
+    if (ioctl(fd, FIONREAD, &avail) < 0 || (size_t)avail < rem)
+        return 0;
+    p->splice_in = rem;
+    return 1;
+}
+
+
+// Read and drop the rest of a request left in the socket for splicing, when
+// it is not going to the helper after all.
+static int
+discard_spliced(struct fd_buf *p)
+{
+    while (p->splice_in > 0) {
+        size_t want = p->splice_in < sizeof(p->buf) ? p->splice_in : sizeof(p->buf);
+        ssize_t len = recv(p->fd, p->buf, want, 0);
+        if (len <= 0)
+            return -1;
+        p->splice_in -= (size_t)len;
+    }
+    return 0;
+}
+
+
+// Account for len bytes received, or -errno.
+static int
+agent_received(int fd, struct fd_buf *p, ssize_t len)
+{
+    int64_t size;
+
+    if (len <= 0) {
+        if (len < 0) {
+            errno = (int)-len;
+            warn("recv(%d)", fd);
+        }
+        return -1;
+    }
+
+    p->recv += len;
+    size = frame_check(p->buf, (size_t)p->recv, AGENT_MAX_MSGLEN);
+    if (size == FRAME_TOO_LONG) {
+        warnx("recv(%d): message of %u bytes is too long", fd, msglen(p->buf));
+        return -1;
+    }
+    if (size == FRAME_PARTIAL) {
+        if (p->recv >= 5 && splice_request(fd, p)) {
+            p->send = 0;
+            return 1;  // queue the request, the rest follows at its turn
+        }
+        return 0;  // more to recv
+    }
+
+    if (p->recv > size) {
+        warnx("recv(%d) = %d (expected %d)",
+              fd, p->recv, msglen(p->buf));
+        return -1;
+    }
+
+    p->send = 0;
+    return 1;  // recv done, queue the request
+}
+
+
+static int
+agent_recv(int fd, struct fd_buf *p)
+{
+    ssize_t len = recv(fd, p->buf + p->recv, recv_room(p), 0);
+    return agent_received(fd, p, len < 0 ? -errno : len);
+}
+
+
+// Account for len bytes sent, or -errno.
+static int
+agent_sent(int fd, struct fd_buf *p, ssize_t len)
+{
+    if (len < 0) {
+        errno = (int)-len;
+        warn("send(%d)", fd);
+        return -1;
+    }
+
+    p->send += len;
+    if (p->send < msglen(p->buf))
+        return 0;  // more to send
+
+    if (p->send > msglen(p->buf)) {
+        warnx("send(%d) = %d (expected %d)",
+              fd, p->send, msglen(p->buf));
+        return -1;
+    }
+
+    p->recv = 0;
+    p->served = 1;
+    return 1;
+}
+
+
+static int
+agent_send(int fd, struct fd_buf *p)
+{
+    ssize_t len = send(fd, p->buf + p->send, (size_t)(msglen(p->buf) - p->send), 0);
+    return agent_sent(fd, p, len < 0 ? -errno : len);
+}
+
+
+#if HAVE_IO_URING
+// Do the recv() and send() calls of a loop round with as few io_uring_enter()
+// calls as the ring allows, rather than one syscall per connection. Results
+// are stored in res by fd, receives first. Returns -1 if the ring is not
+// available.
+static int
+ring_client_io(const fd_set *rset, const fd_set *wset, struct fd_buf **bufs, ssize_t *res)
+{
+    struct uring *r = get_ring();
+    struct io_uring_sqe *sqe;
+    unsigned n = 0;
+    int fd;
+
+    if (r == NULL)
+        return -1;
+
+    FD_FOREACH(fd, rset) {
+        struct fd_buf *p = bufs[fd];
+        if ((sqe = uring_get_sqe(r)) == NULL) {
+            ring_complete(r, n, res);
+            n = 0;
+            sqe = uring_get_sqe(r);
+        }
+        uring_prep_rw(sqe, IORING_OP_RECV, fd, p->buf + p->recv, (unsigned)recv_room(p), (uint64_t)fd);
+        ++n;
+    }
+    FD_FOREACH(fd, wset) {
+        struct fd_buf *p = bufs[fd];
+        if ((sqe = uring_get_sqe(r)) == NULL) {
+            ring_complete(r, n, res);
+            n = 0;
+            sqe = uring_get_sqe(r);
+        }
+        uring_prep_rw(sqe, IORING_OP_SEND, fd, p->buf + p->send, (unsigned)(msglen(p->buf) - p->send),
+                      (uint64_t)(FD_SETSIZE + fd));
+        ++n;
+    }
+    if (n > 0)
+        ring_complete(r, n, res);
+    return 0;
+}
+#endif
+
+
+// Two WSL problems require us to use a weird pseudo-daemon mode:
+//  1. Detaching from the parent terminal breaks Win32 process communication
+//  2. Session members are not sent a SIGHUP when the controlling terminal goes away
+// Therefore, we need this one weird hack where we keep checking if our
+// controlling terminal is gone. If it is, exit since talking to the
+// helper would hang. Sockets (--upstream, --relay) are not affected.
+static void
+check_tty_gone()
+{
+#if !REAL_DAEMONIZE
+    int i;
+
+    for (i = 0; i < nbackends && backends[i] != &win32_backend; ++i)
+        ;
+    if ((tty_gone && opt_no_exit) || i == nbackends)
+        return;
+    int fd = open("/dev/tty", O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOTTY) {
+            // Controlling terminal is gone, kill the helper process so the parent conhost can exit.
+            // The helper needs to be explicitly killed on Windows release 1903 to work around a bug
+            // in Win32 interop that leaves a process hanging.
+            if (win32_pid > 0 && kill(win32_pid, SIGTERM) < 0)
+                err(1, "kill(%d)", win32_pid);
+            if (opt_no_exit) {
+                // Note that the original tty was gone and we don't need to check for it any more.
+                // This allows operating in a pseudo-daemon mode on Windows release 1809 and later
+                // (enabled with the -b flag)..
+                tty_gone = 1;
+            }
+            else {
+                cleanup_exit(0);
+            }
+        }
+        else
+            warn("checking controlling terminal failed");
+    }
+    else
+        // We are still attached to a terminal
+        close(fd);
+#endif
+}
+
+// A client process, as seen by SO_PEERCRED. The requests of all its
+// connections form one flow of the fair queue, weighted up when it runs in
+// the foreground of a terminal (someone is waiting for it).
+struct peer {
+    pid_t pid;
+    uid_t uid;
+    int interactive;
+    uint64_t finish;  // virtual finish time of its last queued request
+    int refs;
+    struct peer *next;
+};
+
+// Connections time out and are evicted in the order they last made progress
+static __thread struct timer_wheel client_timers;
+static __thread struct fd_buf *lru_first = NULL, *lru_last = NULL;
+
+
+static void
+lru_unlink(struct fd_buf *p)
+{
+    if (p->lru_prev)
+        p->lru_prev->lru_next = p->lru_next;
+    else if (lru_first == p)
+        lru_first = p->lru_next;
+    if (p->lru_next)
+        p->lru_next->lru_prev = p->lru_prev;
+    else if (lru_last == p)
+        lru_last = p->lru_prev;
+    p->lru_prev = p->lru_next = NULL;
+}
+
+
+// Note progress on a connection: it becomes the most recently active one and
+// gets a full --client-timeout again.
+static void
+client_touch(struct fd_buf *p)
+{
+    if (lru_last != p) {
+        lru_unlink(p);
+        p->lru_prev = lru_last;
+        if (lru_last)
+            lru_last->lru_next = p;
+        else
+            lru_first = p;
+        lru_last = p;
+    }
+    p->touched_ms = monotonic_ms();
+    // One more tick, as the current second may be almost over
+    if (opt_client_timeout > 0)
+        timer_add(&client_timers, &p->idle_timer, monotonic_now() + opt_client_timeout + 1);
+}
+
+
+static __thread struct peer *peers = NULL;
+
+
+// Whether pid runs in the foreground process group of its controlling
+// terminal, from /proc/<pid>/stat.
+static int
+pid_is_interactive(pid_t pid)
+{
+    char path[32], stat[512], *p;
+    int fd, pgrp, tty, tpgid;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    len = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    stat[len] = 0;
+    // The command name may contain anything, skip past its closing paren
+    if ((p = strrchr(stat, ')')) == NULL ||
+        sscanf(p + 1, " %*c %*d %d %*d %d %d", &pgrp, &tty, &tpgid) != 3)
+        return 0;
+    return tty != 0 && tpgid == pgrp;
+}
+
+
+static struct peer *
+peer_get(int fd)
+{
+    struct ucred cred = { 0, 0, 0 };
+    socklen_t len = sizeof(cred);
+    struct peer *peer;
+
+    // Clients whose credentials can't be read share one flow (pid 0)
+    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+    for (peer = peers; peer; peer = peer->next) {
+        if (peer->pid == cred.pid && peer->uid == cred.uid) {
+            ++peer->refs;
+            return peer;
+        }
+    }
+    if ((peer = calloc(1, sizeof(*peer))) == NULL)
+        return NULL;
+    peer->pid = cred.pid;
+    peer->uid = cred.uid;
+    peer->interactive = cred.pid > 0 && pid_is_interactive(cred.pid);
+    peer->refs = 1;
+    peer->next = peers;
+    peers = peer;
+    debug_print("new peer pid %d uid %d%s", peer->pid, peer->uid, peer->interactive ? " (interactive)" : "");
+    return peer;
+}
+
+
+static void
+peer_put(struct peer *peer)
+{
+    struct peer **pp;
+
+    if (!peer || --peer->refs > 0)
+        return;
+    for (pp = &peers; *pp; pp = &(*pp)->next) {
+        if (*pp == peer) {
+            *pp = peer->next;
+            break;
+        }
+    }
+    free(peer);
+}
+
+
+static int
+add_client(int fd, struct listener *listener, struct fd_buf **bufs, fd_set *read_set, int *nclients)
+{
+    bufs[fd] = calloc(1, sizeof(struct fd_buf));
+    if (!bufs[fd])
+        return -1;
+    if ((bufs[fd]->peer = peer_get(fd)) == NULL) {
+        free(bufs[fd]);
+        bufs[fd] = NULL;
+        return -1;
+    }
+    bufs[fd]->fd = fd;
+    bufs[fd]->listener = listener;
+    // agent_relay() must not wait for a client to read its reply
+    if (opt_splice)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    FD_SET(fd, read_set);
+    ++*nclients;
+    client_touch(bufs[fd]);
+    return 0;
+}
+
+
+// Complete requests waiting for the helper, in arrival order. They are
+// served by self-clocked fair queueing among peers: each request is tagged
+// with a virtual finish time, which advances by SCHED_COST divided by the
+// weight of its peer from the later of the peer's previous request and the
+// request in service. The smallest tag goes first, so a peer which sends a
+// request now and then is served almost at once, however long the queue of
+// a busy one is.
+#define SCHED_COST 840  // divisible by all weights up to 8
+
+static __thread struct fd_buf *queue_first = NULL, *queue_last = NULL;
+static __thread int nqueued = 0;
+static __thread uint64_t sched_vtime = 0;
+
+
+static void
+enqueue_request(struct fd_buf *p)
+{
+    struct peer *peer = p->peer;
+    uint64_t start = peer->finish > sched_vtime ? peer->finish : sched_vtime;
+
+    p->finish = start + SCHED_COST / (uint64_t)(peer->interactive ? opt_interactive_weight : 1);
+    peer->finish = p->finish;
+    p->queued = 1;
+    p->queue_next = NULL;
+    if (queue_last)
+        queue_last->queue_next = p;
+    else
+        queue_first = p;
+    queue_last = p;
+    ++nqueued;
+    // The wait is ours, not the client's
+    timer_del(&client_timers, &p->idle_timer);
+}
+
+
+// The queued request with the earliest finish time, the oldest one on ties
+static struct fd_buf *
+next_request()
+{
+    struct fd_buf *p, *best = queue_first;
+
+    for (p = queue_first; p; p = p->queue_next) {
+        if (p->finish < best->finish)
+            best = p;
+    }
+    return best;
+}
+
+
+static void
+dequeue_request(struct fd_buf *p)
+{
+    struct fd_buf *prev = NULL, *q;
+
+    // Usually the first one, the queue is short otherwise
+    for (q = queue_first; q && q != p; q = q->queue_next)
+        prev = q;
+    if (q) {
+        if (prev)
+            prev->queue_next = p->queue_next;
+        else
+            queue_first = p->queue_next;
+        if (queue_last == p)
+            queue_last = prev;
+    }
+    p->queued = 0;
+    p->queue_next = NULL;
+    --nqueued;
+}
+
+
+// Take the next requests in turn for the helper: up to --batch of them which
+// it only needs to answer, as long as they fit in the pipe together. Writing
+// them then never blocks while the helper waits to hand back a reply.
+static int
+take_batch(struct fd_buf **batch)
+{
+    size_t bytes = 0;
+    int n = 0;
+
+    while (queue_first && n < opt_batch) {
+        struct fd_buf *p = next_request();
+        if (n > 0 && (!batchable(p) || bytes + msglen(p->buf) > win32_pipe_size))
+            break;
+        dequeue_request(p);
+        sched_vtime = p->finish;
+        batch[n++] = p;
+        bytes += msglen(p->buf);
+        if (!batchable(p))
+            break;
+    }
+    return n;
+}
+
+
+static void
+close_client(int fd, struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    FD_CLR(fd, read_set);
+    FD_CLR(fd, write_set);
+    close(fd);
+    if (bufs[fd]->queued)
+        dequeue_request(bufs[fd]);
+    peer_put(bufs[fd]->peer);
+    timer_del(&client_timers, &bufs[fd]->idle_timer);
+    lru_unlink(bufs[fd]);
+    free(bufs[fd]);
+    bufs[fd] = NULL;
+    --*nclients;
+}
+
+
+// Make room for a new connection at --max-clients by closing the least
+// recently active one which is waiting for its next request. Returns the
+// closed descriptor, or -1 if every connection is in the middle of one or
+// has yet to send its first.
+static struct fd_buf *
+oldest_idle_client(fd_set *read_set)
+{
+    struct fd_buf *p;
+
+    for (p = lru_first; p; p = p->lru_next) {
+        if (p->served && p->recv == 0 && FD_ISSET(p->fd, read_set))
+            return p;
+    }
+    return NULL;
+}
+
+
+static int
+evict_idle_client(struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    struct fd_buf *p = oldest_idle_client(read_set);
+    int fd;
+
+    if (p == NULL)
+        return -1;
+    fd = p->fd;
+    debug_print("evicting idle connection %d", fd);
+    close_client(fd, bufs, read_set, write_set, nclients);
+    return fd;
+}
+
+
+// With --workers the connections are theirs: ask the worker holding the
+// least recently active idle one to close it. Returns 0 if it was asked, -1
+// if no worker has an idle connection.
+static int
+evict_worker_client()
+{
+    struct handoff h = { EVICT_ONE, 0 };
+    int64_t oldest = 0, t;
+    int i, victim = -1;
+
+    for (i = 0; i < opt_workers; ++i) {
+        t = __atomic_load_n(&workers[i].oldest_idle_ms, __ATOMIC_RELAXED);
+        if (t != 0 && (victim < 0 || t < oldest)) {
+            oldest = t;
+            victim = i;
+        }
+    }
+    if (victim < 0 || write(workers[victim].handoff[1], &h, sizeof(h)) != sizeof(h))
+        return -1;
+    debug_print("asked worker %d to evict an idle connection", victim);
+    return 0;
+}
+
+
+struct client_sets {
+    struct fd_buf **bufs;
+    fd_set *read_set, *write_set;
+    int *nclients;
+};
+
+
+static void
+client_timed_out(struct timer *t, void *arg)
+{
+    struct client_sets *cs = arg;
+    struct fd_buf *p = (struct fd_buf *)((char *)t - offsetof(struct fd_buf, idle_timer));
+
+    debug_print("connection %d timed out", p->fd);
+    close_client(p->fd, cs->bufs, cs->read_set, cs->write_set, cs->nclients);
+}
+
+
+// Connections of the acceptor (none with --workers) and of all workers
+static int
+total_clients(int nclients)
+{
+    int i;
+
+    for (i = 0; i < opt_workers; ++i)
+        nclients += __atomic_load_n(&workers[i].nclients, __ATOMIC_SEQ_CST);
+    return nclients;
+}
+
+
+static void
+drop_idle_clients(struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    int fd;
+
+    FD_FOREACH(fd, read_set) {
+        if (bufs[fd]->recv == 0)
+            close_client(fd, bufs, read_set, write_set, nclients);
+    }
+}
+
+
+// Stop accepting new connections and drop the clients which are not in the
+// middle of a request. Remaining clients are served until they go idle or
+// the drain deadline passes.
+static void
+start_drain(struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    int i;
+
+    debug_print("draining %d connection(s) for up to %d second(s)", total_clients(*nclients), opt_drain_timeout);
+
+    // Remove the sockets right away, so that new clients fail fast and --reuse
+    // starts a fresh agent instead of connecting to a dying one. After an
+    // upgrade the sockets belong to the new binary and this is already done.
+    for (i = 0; i < nlisteners; ++i) {
+        if (listeners[i].fd >= 0) {
+            FD_CLR(listeners[i].fd, read_set);
+            close(listeners[i].fd);
+            listeners[i].fd = -1;
+        }
+        if (listeners[i].path[0]) {
+            unlink(listeners[i].path);
+            listeners[i].path[0] = 0;
+        }
+    }
+    if (cleanup_pidpath[0]) {
+        unlink(cleanup_pidpath);
+        cleanup_pidpath[0] = 0;
+    }
+    remove_env_files();
+
+    // Wake up the workers, they drain their own connections
+    for (i = 0; i < opt_workers; ++i)
+        close(workers[i].handoff[1]);
+
+    drop_idle_clients(bufs, read_set, write_set, nclients);
+}
+
+
+static int
+send_upgrade_msg(int fd, const struct upgrade_msg *msg, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+    struct iovec iov = { (void *)msg, sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (nfds > 0) {
+        struct cmsghdr *cm;
+        memset(cbuf, 0, sizeof(cbuf));
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+
+    while (sendmsg(fd, &mh, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+
+// Runs in the forked copy of the old daemon: wait until the new binary asks
+// for them, then pass it the listening sockets and the idle clients. Clients
+// in the middle of a request stay here and are drained.
+static void
+hand_over_sockets(int fd, struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    struct upgrade_msg msg;
+    int fds[UPGRADE_FDS_PER_MSG];
+    int nfds = 0, cfd, i;
+    ssize_t cnt;
+    char c;
+
+    // EOF here means the exec failed and the parent carries on serving
+    do
+        cnt = read(fd, &c, 1);
+    while (cnt < 0 && errno == EINTR);
+    if (cnt != 1)
+        _exit(0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.tag = 'L';
+    // The sources are PATH_MAX long as well
+    memcpy(msg.sockpath, listeners[0].path, sizeof(msg.sockpath));
+    memcpy(msg.tempdir, cleanup_tempdir, sizeof(msg.tempdir));
+    memcpy(msg.pidpath, cleanup_pidpath, sizeof(msg.pidpath));
+    msg.activated = socket_activated ? (uint8_t)nlisteners : 0;
+    for (i = 0; i < nlisteners; ++i)
+        fds[i] = listeners[i].fd;
+    if (send_upgrade_msg(fd, &msg, fds, nlisteners) < 0)
+        _exit(1);
+
+    msg.tag = 'C';
+    FD_FOREACH(cfd, read_set) {
+        if (!bufs[cfd] || bufs[cfd]->recv != 0)
+            continue;
+        msg.owner[nfds] = (uint8_t)(bufs[cfd]->listener - listeners);
+        fds[nfds++] = cfd;
+        if (nfds == UPGRADE_FDS_PER_MSG) {
+            if (send_upgrade_msg(fd, &msg, fds, nfds) < 0)
+                _exit(1);
+            nfds = 0;
+        }
+    }
+    if (nfds > 0 && send_upgrade_msg(fd, &msg, fds, nfds) < 0)
+        _exit(1);
+
+    msg.tag = 'E';
+    if (send_upgrade_msg(fd, &msg, NULL, 0) < 0)
+        _exit(1);
+    close(fd);
+
+    // Everything is in the new binary now, forget about it without touching
+    // the filesystem.
+    for (i = 0; i < nlisteners; ++i) {
+        FD_CLR(listeners[i].fd, read_set);
+        close(listeners[i].fd);
+        listeners[i].fd = -1;
+        listeners[i].path[0] = 0;
+    }
+    cleanup_tempdir[0] = 0;
+    cleanup_pidpath[0] = 0;
+    cleanup_envpath[0] = 0;  // still valid: the new binary keeps our pid and socket
+
+    FD_FOREACH(cfd, read_set) {
+        if (bufs[cfd]->recv == 0)
+            close_client(cfd, bufs, read_set, write_set, nclients);
+    }
+
+    debug_print("upgrade: sockets handed over, draining %d connection(s)", *nclients);
+    drain_requested = 1;
+}
+
+
+// Replace the running binary with the one at self_exe_path while keeping our
+// PID and the listening sockets. The process forks, the parent execs the new
+// binary and the child passes it the sockets over SCM_RIGHTS, then drains.
+static void
+start_upgrade(struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    int sv[2];
+    pid_t pid;
+    char fdstr[16];
+
+    upgrade_requested = 0;
+
+    if (subcommand_pid > 0) {
+        warnx("upgrade is not supported in subcommand mode");
+        return;
+    }
+    if (opt_workers > 0) {
+        warnx("upgrade is not supported with --workers");
+        return;
+    }
+    if (access(self_exe_path, X_OK) < 0) {
+        warn("upgrade: %s", self_exe_path);
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        warn("upgrade: socketpair");
+        return;
+    }
+
+    if ((pid = fork()) < 0) {
+        warn("upgrade: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        hand_over_sockets(sv[1], bufs, read_set, write_set, nclients);
+        return;
+    }
+
+    close(sv[1]);
+    debug_print("upgrade: executing %s", self_exe_path);
+
+    // Same command line as the one we were started with, the new binary
+    // ignores everything related to creating the socket.
+    char **argv = calloc((size_t)saved_argc + 3, sizeof(char *));
+    if (!argv) {
+        warnx("upgrade: No memory");
+        close(sv[0]);
+        return;
+    }
+    snprintf(fdstr, sizeof(fdstr), "%d", sv[0]);
+    argv[0] = saved_argv[0];
+    argv[1] = "--upgrade-fd";
+    argv[2] = fdstr;
+    memcpy(argv + 3, saved_argv + 1, sizeof(char *) * (size_t)(saved_argc - 1));
+
+    fcntl(sv[0], F_SETFD, 0);
+    execv(self_exe_path, argv);
+
+    warn("upgrade: exec %s", self_exe_path);
+    free(argv);
+    close(sv[0]);  // the child sees EOF and goes away
+}
+
+
+// Counterpart of hand_over_sockets() in the new binary. Sets up the listeners
+// (which the command line has declared in the same order as before), fills in
+// the main socket path and the clients that were idle.
+static void
+receive_upgrade(int fd, char *sockpath, size_t len, struct inherited_client *clients, int *nclients)
+{
+    struct upgrade_msg msg;
+    char cbuf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+    int nreceived = 0;
+
+    *nclients = 0;
+    if (write(fd, "u", 1) != 1)
+        err(1, "upgrade: write");
+
+    while (1) {
+        struct iovec iov = { &msg, sizeof(msg) };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+        struct cmsghdr *cm;
+        ssize_t cnt = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt < 0)
+            err(1, "upgrade: recvmsg");
+        if (cnt != sizeof(msg))
+            errx(1, "upgrade: unexpected message of %zd bytes", cnt);
+        if (msg.tag == 'E')
+            break;
+        if (msg.tag == 'L' && msg.activated > 0 && msg.activated <= MAX_LISTENERS) {
+            // The command line may not list the sockets at all
+            nlisteners = msg.activated;
+            socket_activated = 1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                continue;
+            int i, n = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *fds = (int *)CMSG_DATA(cm);
+            for (i = 0; i < n; ++i) {
+                if (msg.tag == 'L' && nreceived < nlisteners)
+                    listeners[nreceived++].fd = fds[i];
+                else if (msg.tag == 'C' && fds[i] < FD_SETSIZE && msg.owner[i] < nreceived) {
+                    clients[*nclients].fd = fds[i];
+                    clients[*nclients].listener = msg.owner[i];
+                    ++*nclients;
+                }
+                else
+                    close(fds[i]);
+            }
+        }
+
+        if (msg.tag == 'L') {
+            msg.sockpath[sizeof(msg.sockpath) - 1] = 0;
+            msg.tempdir[sizeof(msg.tempdir) - 1] = 0;
+            msg.pidpath[sizeof(msg.pidpath) - 1] = 0;
+            snprintf(sockpath, len, "%s", msg.sockpath);
+            strcpy(listeners[0].path, msg.sockpath);
+            strcpy(cleanup_tempdir, msg.tempdir);
+            strcpy(cleanup_pidpath, msg.pidpath);
+        }
+    }
+    close(fd);
+
+    if (nreceived < nlisteners)
+        errx(1, "upgrade: got %d listening socket(s), expected %d", nreceived, nlisteners);
+    for (int i = 1; i < nlisteners && !socket_activated; ++i)
+        strncpy(listeners[i].path, listeners[i].name, sizeof(listeners[i].path) - 1);
+    if (socket_activated)
+        opt_no_exit = tty_gone = 1;
+    debug_print("upgrade: got socket %s and %d idle client(s)", sockpath, *nclients);
+}
+
+
+static void agent_loop(const struct inherited_client *clients, int nclients_inherited, struct worker *self);
+
+
+static void *
+worker_main(void *arg)
+{
+    agent_loop(NULL, 0, arg);
+    return NULL;
+}
+
+
+static void
+start_workers()
+{
+    sigset_t all, old;
+    int i;
+
+    if ((workers = calloc((size_t)opt_workers, sizeof(*workers))) == NULL)
+        cleanup_warn("start_workers");
+    if (pipe2(acceptor_wake, O_CLOEXEC | O_NONBLOCK) < 0)
+        cleanup_warn("start_workers pipe");
+
+    // Signals are handled by the acceptor
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < opt_workers; ++i) {
+        if (pipe2(workers[i].handoff, O_CLOEXEC) < 0)
+            cleanup_warn("start_workers pipe");
+        fcntl(workers[i].handoff[0], F_SETFL, O_NONBLOCK);
+        if ((errno = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) != 0)
+            cleanup_warn("pthread_create");
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    debug_print("started %d worker thread(s)", opt_workers);
+}
 
-    // Pass query to Windows ssh-agent
-    if (agent_query(p->buf) != 0)
-        return -1;
 
-    p->send = 0;
-    return 1;  // recv done, move to send phase
+// Longest time a loop has been waiting on its backend, in ms
+static uint32_t
+busy_ms()
+{
+    int64_t now = monotonic_ms(), oldest = __atomic_load_n(&acceptor_busy_since, __ATOMIC_RELAXED);
+    int i;
+
+    for (i = 0; i < opt_workers; ++i) {
+        int64_t since = __atomic_load_n(&workers[i].busy_since, __ATOMIC_RELAXED);
+        if (since && (!oldest || since < oldest))
+            oldest = since;
+    }
+    if (!oldest)
+        return 0;
+    return now - oldest < UINT32_MAX ? (uint32_t)(now - oldest) + 1 : UINT32_MAX;
 }
 
 
-static int
-agent_send(int fd, struct fd_buf *p)
+static void *
+busy_main(void *arg)
 {
-    ssize_t len = send(fd, p->buf + p->send, (size_t)(msglen(p->buf) - p->send), 0);
-    if (len < 0) {
-        warn("send(%d)", fd);
-        return -1;
-    }
+    int fd = (int)(intptr_t)arg, s;
 
-    p->send += len;
-    if (p->send < msglen(p->buf))
-        return 0;  // more to send
+    while ((s = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        uint8_t reply[4];
 
-    if (p->send > msglen(p->buf)) {
-        warnx("send(%d) = %d (expected %d)",
-              fd, p->send, msglen(p->buf));
-        return -1;
+        if (s < 0)
+            continue;
+        if (peer_is_same_user(s)) {
+            put_u32(reply, busy_ms());
+            if (send(s, reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+                debug_print("busy reply: %s", strerror(errno));
+        }
+        close(s);
     }
-
-    p->recv = 0;
-    return 1;
+    warn("busy accept");
+    return NULL;
 }
 
 
-// Two WSL problems require us to use a weird pseudo-daemon mode:
-//  1. Detaching from the parent terminal breaks Win32 process communication
-//  2. Session members are not sent a SIGHUP when the controlling terminal goes away
-// Therefore, we need this one weird hack where we keep checking if our
-// controlling terminal is gone. If it is, exit since talking to the
-// helper would hang.
+// Answer agent_busy_ms() of a --reuse probe, which the loops cannot while
+// they wait on their backends. Without it, a busy agent is replaced.
 static void
-check_tty_gone()
+start_busy_responder()
 {
-#if !REAL_DAEMONIZE
-    if (tty_gone && opt_no_exit)
+    struct sockaddr_un addr;
+    socklen_t addrlen = busy_socket_address(getpid(), &addr);
+    sigset_t all, old;
+    pthread_t thread;
+    int fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addrlen) < 0 || listen(fd, 8) < 0) {
+        debug_print("busy socket: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
         return;
-    int fd = open("/dev/tty", O_RDONLY);
-    if (fd < 0) {
-        if (errno == ENOTTY) {
-            // Controlling terminal is gone, kill the helper process so the parent conhost can exit.
-            // The helper needs to be explicitly killed on Windows release 1903 to work around a bug
-            // in Win32 interop that leaves a process hanging.
-            if (win32_pid > 0 && kill(win32_pid, SIGTERM) < 0)
-                err(1, "kill(%d)", win32_pid);
-            if (opt_no_exit) {
-                // Note that the original tty was gone and we don't need to check for it any more.
-                // This allows operating in a pseudo-daemon mode on Windows release 1809 and later
-                // (enabled with the -b flag)..
-                tty_gone = 1;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if ((errno = pthread_create(&thread, NULL, busy_main, (void *)(intptr_t)fd)) != 0) {
+        debug_print("busy thread: %s", strerror(errno));
+        close(fd);
+    }
+    else
+        pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+// Take the connections the acceptor has handed to this worker, and close the
+// ones it asks for to make room. Returns the last descriptor closed, or -1.
+static int
+receive_clients(struct worker *self, struct fd_buf **bufs, fd_set *read_set, fd_set *write_set, int *nclients)
+{
+    struct handoff h[64];
+    ssize_t cnt;
+    int i, evicted = -1, fd;
+
+    while ((cnt = read(self->handoff[0], h, sizeof(h))) > 0) {
+        for (i = 0; i < (int)(cnt / (ssize_t)sizeof(h[0])); ++i) {
+            if (h[i].fd == EVICT_ONE) {
+                // The acceptor waits for a connection to go in any case
+                if ((fd = evict_idle_client(bufs, read_set, write_set, nclients)) >= 0)
+                    evicted = fd;
+            }
+            else if (add_client(h[i].fd, &listeners[h[i].listener], bufs, read_set, nclients) < 0) {
+                warnx("calloc: No memory");
+                close(h[i].fd);
             }
             else {
-                cleanup_exit(0);
+                if (opt_prefetch)
+                    prefetch_start(bufs[h[i].fd]);
+                if (opt_prewarm)
+                    backends_start();
             }
         }
-        else
-            warn("checking controlling terminal failed");
     }
-    else
-        // We are still attached to a terminal
-        close(fd);
-#endif
+    if (cnt == 0)
+        FD_CLR(self->handoff[0], read_set);  // the acceptor is draining
+    return evicted;
 }
 
+
+// The main loop. With self, it is the loop of a worker thread, which serves
+// the connections the acceptor passes it and returns once it has drained.
 static void
-do_agent_loop(int sockfd)
+agent_loop(const struct inherited_client *clients, int nclients_inherited, struct worker *self)
 {
-    int fd;
+    int fd, i;
+    int nclients = 0;
+    unsigned next_worker = 0;
+    int draining = 0;
+    int accepting_paused = 0;
+    time_t drain_deadline = 0;
+    time_t idle_since = monotonic_now();
     fd_set read_set, write_set;
     struct fd_buf *bufs[FD_SETSIZE] = { NULL };
+    static __thread ssize_t io_res[2 * FD_SETSIZE];  // results of ring_client_io()
+    int batched = 0;
+    struct client_sets timer_sets = { bufs, &read_set, &write_set, &nclients };
+    int64_t *busy_since = self ? &self->busy_since : &acceptor_busy_since;
 
     FD_ZERO(&read_set);
     FD_ZERO(&write_set);
-    FD_SET(sockfd, &read_set);
+    timer_wheel_init(&client_timers, monotonic_now());
+    if (self)
+        FD_SET(self->handoff[0], &read_set);
+    else if (opt_workers > 0)
+        start_workers();
+    if (!self)
+        start_busy_responder();
+    for (i = 0; i < nlisteners && !self; ++i) {
+        FD_SET(listeners[i].fd, &read_set);
+        listeners[i].abstract = socket_is_abstract(listeners[i].fd);
+        // accept() until the backlog is empty
+        fcntl(listeners[i].fd, F_SETFL, fcntl(listeners[i].fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    for (i = 0; i < nclients_inherited; ++i) {
+        fd = clients[i].fd;
+        if (add_client(fd, &listeners[clients[i].listener], bufs, &read_set, &nclients) < 0)
+            close(fd);
+    }
 
     while (1) {
+        if (self) {
+            struct fd_buf *idle = opt_max_clients > 0 ? oldest_idle_client(&read_set) : NULL;
+            int before = __atomic_exchange_n(&self->nclients, nclients, __ATOMIC_SEQ_CST);
+            // Let a paused acceptor know as soon as there is room
+            if (nclients < before && __atomic_load_n(&accept_paused, __ATOMIC_SEQ_CST) &&
+                write(acceptor_wake[1], "", 1) < 0 && errno != EAGAIN)
+                debug_print("could not wake the acceptor (%d)", errno);
+            __atomic_store_n(&self->nqueued, nqueued, __ATOMIC_RELAXED);
+            __atomic_store_n(&self->oldest_idle_ms, idle ? idle->touched_ms : 0, __ATOMIC_RELAXED);
+            if (drain_requested && !draining) {
+                FD_CLR(self->handoff[0], &read_set);
+                drop_idle_clients(bufs, &read_set, &write_set, &nclients);
+                draining = 1;
+            }
+            // The acceptor exits at the drain deadline
+            if (draining && nclients == 0) {
+                __atomic_store_n(&self->nclients, 0, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+
+        if (upgrade_requested && !draining && !self)
+            start_upgrade(bufs, &read_set, &write_set, &nclients);
+
+        if (stats_requested && !self) {
+            int queued = nqueued;
+            stats_requested = 0;
+            for (i = 0; i < opt_workers; ++i)
+                queued += __atomic_load_n(&workers[i].nqueued, __ATOMIC_RELAXED);
+            char health[512] = "";
+            for (i = 0; i < nbackends; ++i) {
+                size_t len = strlen(health);
+                snprintf(health + len, sizeof(health) - len, ", %s %s", backends[i]->name,
+                         backends[i]->healthy(backends[i]) ? "up" : "down");
+            }
+            if (opt_hedge) {
+                size_t len = strlen(health);
+                unsigned long sent, won;
+                upstream_hedge_stats(&sent, &won);
+                snprintf(health + len, sizeof(health) - len, ", %lu hedged request(s) (%lu won by the copy)",
+                         sent, won);
+            }
+            warnx("%d connection(s), %d queued request(s), %lu shed request(s), accepting paused %lu time(s)%s",
+                  total_clients(nclients), queued, __atomic_load_n(&shed_requests, __ATOMIC_RELAXED),
+                  accept_pauses, health);
+        }
+
+        if (drain_requested && !self) {
+            if (!draining) {
+                start_drain(bufs, &read_set, &write_set, &nclients);
+                drain_deadline = monotonic_now() + opt_drain_timeout;
+                draining = 1;
+            }
+            if (total_clients(nclients) == 0)
+                cleanup_exit(0);
+            if (monotonic_now() >= drain_deadline) {
+                debug_print("drain deadline passed with %d connection(s) left", nclients);
+                cleanup_exit(0);
+            }
+        }
+
+        if (opt_client_timeout > 0)
+            timer_wheel_advance(&client_timers, monotonic_now(), client_timed_out, &timer_sets);
+
+        // Serve one queued request (or --batch) per round, so that replies,
+        // new requests and the queue limit keep up while the helper is busy.
+        if (queue_first) {
+            struct fd_buf *batch[MAX_BATCH];
+            int n = take_batch(batch);
+            int res;
+
+            __atomic_store_n(busy_since, monotonic_ms(), __ATOMIC_RELAXED);
+            res = n == 1 ? agent_request(batch[0]) : agent_query_batch(batch, n);
+            __atomic_store_n(busy_since, 0, __ATOMIC_RELAXED);
+
+            for (i = 0; i < n; ++i) {
+                if (res != 0)
+                    close_client(batch[i]->fd, bufs, &read_set, &write_set, &nclients);
+                else {
+                    FD_SET(batch[i]->fd, &write_set);
+                    client_touch(batch[i]);
+                }
+            }
+        }
+
+        // Resume accepting once a connection has gone away
+        if (accepting_paused && !draining && total_clients(nclients) < opt_max_clients) {
+            for (i = 0; i < nlisteners; ++i) {
+                if (listeners[i].fd >= 0)
+                    FD_SET(listeners[i].fd, &read_set);
+            }
+            accepting_paused = 0;
+            __atomic_store_n(&accept_paused, 0, __ATOMIC_SEQ_CST);
+        }
+
         fd_set do_read_set = read_set;
         fd_set do_write_set = write_set;
+        // Not in read_set, which only holds clients besides the listeners
+        if (accepting_paused && opt_workers > 0 && !self)
+            FD_SET(acceptor_wake[0], &do_read_set);
 #if REAL_DAEMONIZE
-        struct timeval *timeoutp = NULL;
+        struct timeval timeout = { 1, 0 }, *timeoutp =
+            (drain_requested || opt_idle_timeout || opt_client_timeout || opt_helper_idle) ?
+            &timeout : NULL;
 #else
         struct timeval timeout = { 1, 0 }, *timeoutp = &timeout;
 #endif
+        if (queue_first) {
+            // Only look for what is ready now, then get on with the queue
+            timeout.tv_sec = 0;
+            timeoutp = &timeout;
+        }
         int ready_fds;
 
         if ((ready_fds = select(FD_SETSIZE, &do_read_set, &do_write_set, NULL, timeoutp)) < 0) {
@@ -579,63 +3303,175 @@ do_agent_loop(int sockfd)
                 cleanup_warn("select");
         }
 
+        if (opt_helper_idle > 0) {
+            __atomic_store_n(busy_since, monotonic_ms(), __ATOMIC_RELAXED);
+            prefetch_finish();  // the helper still has an answer to give
+            __atomic_store_n(busy_since, 0, __ATOMIC_RELAXED);
+            for (i = 0; i < nbackends; ++i)
+                backends[i]->release_idle(backends[i], (int64_t)opt_helper_idle * 1000);
+        }
+
+        if (ready_fds == 0 && (queue_first || self))
+            continue;
         if (ready_fds == 0) {
             // select timed out
             check_tty_gone();
+            // Nothing is pending on the listeners either, as select() says
+            if (opt_idle_timeout > 0 && total_clients(nclients) == 0 && !draining &&
+                monotonic_now() - idle_since >= opt_idle_timeout) {
+                debug_print("idle for %d seconds, exiting", opt_idle_timeout);
+                cleanup_exit(0);
+            }
             continue;
         }
+        idle_since = monotonic_now();
 
-        if (FD_ISSET(sockfd, &do_read_set)) {
-            int s = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
-            if (s >= FD_SETSIZE) {
-                warnx("accept: Too many connections");
-                close(s);
+        if (accepting_paused && opt_workers > 0 && !self && FD_ISSET(acceptor_wake[0], &do_read_set)) {
+            char wake[64];
+            FD_CLR(acceptor_wake[0], &do_read_set);
+            while (read(acceptor_wake[0], wake, sizeof(wake)) > 0)
+                ;
+        }
+
+        if (self && FD_ISSET(self->handoff[0], &do_read_set)) {
+            FD_CLR(self->handoff[0], &do_read_set);
+            if ((fd = receive_clients(self, bufs, &read_set, &write_set, &nclients)) >= 0) {
+                FD_CLR(fd, &do_read_set);
+                FD_CLR(fd, &do_write_set);
             }
-            else if (s < 0)
-                warn("accept");
-            else {
-                bufs[s] = calloc(1, sizeof(struct fd_buf));
-                if (!bufs[s]) {
+        }
+
+        for (i = 0; i < nlisteners && !self; ++i) {
+            int sockfd = listeners[i].fd;
+            if (sockfd < 0 || !FD_ISSET(sockfd, &do_read_set))
+                continue;
+            FD_CLR(sockfd, &do_read_set);
+
+            // Take the whole backlog, so that the limits below see every
+            // client which is waiting rather than one per round.
+            while (1) {
+                if (opt_max_clients > 0 && total_clients(nclients) >= opt_max_clients) {
+                    // Only make room for a client which is actually waiting
+                    struct pollfd pending = { sockfd, POLLIN, 0 };
+                    if (poll(&pending, 1, 0) <= 0)
+                        break;
+                    if (opt_workers == 0 && (fd = evict_idle_client(bufs, &read_set, &write_set, &nclients)) >= 0) {
+                        FD_CLR(fd, &do_read_set);
+                        FD_CLR(fd, &do_write_set);
+                    }
+                    else {
+                        // Every connection is busy, or a worker is closing
+                        // one: leave new ones waiting in the listen backlog
+                        // until one goes away.
+                        if (opt_workers == 0 || evict_worker_client() < 0) {
+                            debug_print("%d connections busy, pausing accept", total_clients(nclients));
+                            ++accept_pauses;
+                        }
+                        for (int j = 0; j < nlisteners; ++j) {
+                            if (listeners[j].fd >= 0) {
+                                FD_CLR(listeners[j].fd, &read_set);
+                                FD_CLR(listeners[j].fd, &do_read_set);
+                            }
+                        }
+                        accepting_paused = 1;
+                        __atomic_store_n(&accept_paused, 1, __ATOMIC_SEQ_CST);
+                        break;
+                    }
+                }
+
+                int s = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+                if (s < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        warn("accept");
+                    break;
+                }
+                if (s >= FD_SETSIZE) {
+                    warnx("accept: Too many connections");
+                    close(s);
+                    break;
+                }
+                if (listeners[i].abstract && !peer_is_same_user(s)) {
+                    debug_print("rejected connection from another user");
+                    close(s);
+                }
+                else if (opt_workers > 0) {
+                    struct handoff h = { s, i };
+                    if (write(workers[next_worker++ % (unsigned)opt_workers].handoff[1], &h, sizeof(h)) != sizeof(h)) {
+                        warn("handoff");
+                        close(s);
+                    }
+                }
+                else if (add_client(s, &listeners[i], bufs, &read_set, &nclients) < 0) {
                     warnx("calloc: No memory");
                     close(s);
+                    break;
+                }
+                else {
+                    // Most clients send a request right away, get the helper
+                    // started while they do, or even the listing they will
+                    // most likely ask for.
+                    if (opt_prefetch)
+                        prefetch_start(bufs[s]);
+                    if (opt_prewarm)
+                        backends_start();
                 }
-                else
-                    FD_SET(s, &read_set);
             }
-            FD_CLR(sockfd, &do_read_set);
         }
 
+#if HAVE_IO_URING
+        batched = opt_io_uring && ring_client_io(&do_read_set, &do_write_set, bufs, io_res) == 0;
+#endif
+
         FD_FOREACH(fd, &do_read_set) {
-            int res = agent_recv(fd, bufs[fd]);
-            if (res != 0) {
+            int res = batched ? agent_received(fd, bufs[fd], io_res[fd]) : agent_recv(fd, bufs[fd]);
+            if (res < 0) {
+                close_client(fd, bufs, &read_set, &write_set, &nclients);
+                continue;
+            }
+            client_touch(bufs[fd]);
+            if (res > 0) {
                 FD_CLR(fd, &read_set);
-                if (res < 0) {
-                    close(fd);
-                    free(bufs[fd]);
-                    bufs[fd] = NULL;
+                if (opt_max_queue > 0 && nqueued >= opt_max_queue) {
+                    // Failing now beats a wait which only grows
+                    debug_print("%d requests queued, shedding request %d", nqueued, bufs[fd]->buf[4]);
+                    if (discard_spliced(bufs[fd]) != 0) {
+                        close_client(fd, bufs, &read_set, &write_set, &nclients);
+                        continue;
+                    }
+                    set_failure(bufs[fd]->buf);
+                    __atomic_add_fetch(&shed_requests, 1, __ATOMIC_RELAXED);
+                    FD_SET(fd, &write_set);
                 }
                 else
-                    FD_SET(fd, &write_set);
+                    enqueue_request(bufs[fd]);
             }
         }
 
         FD_FOREACH(fd, &do_write_set) {
-            int res = agent_send(fd, bufs[fd]);
-            if (res != 0) {
+            int res = batched ? agent_sent(fd, bufs[fd], io_res[FD_SETSIZE + fd]) : agent_send(fd, bufs[fd]);
+            if (res < 0 || (res > 0 && drain_requested)) {
+                // While draining, a client is done once its reply is out
+                close_client(fd, bufs, &read_set, &write_set, &nclients);
+                continue;
+            }
+            client_touch(bufs[fd]);
+            if (res > 0) {
                 FD_CLR(fd, &write_set);
-                if (res < 0) {
-                    close(fd);
-                    free(bufs[fd]);
-                    bufs[fd] = NULL;
-                }
-                else
-                    FD_SET(fd, &read_set);
+                FD_SET(fd, &read_set);
             }
         }
     }
 }
 
 
+static void
+do_agent_loop(const struct inherited_client *clients, int nclients)
+{
+    agent_loop(clients, nclients, NULL);
+    cleanup_exit(0);  // not reached, the acceptor exits from the loop
+}
+
+
 // Quote and escape a string for shell eval.
 // Caller must free the result.
 static char *
@@ -703,29 +3539,104 @@ output_unset_env(const shell_type opt_sh)
 
 
 static void
-output_set_env(const shell_type opt_sh, const int p_set_pid_env, const char *escaped_sockpath, const pid_t pid)
+output_set_env(FILE *out, const shell_type opt_sh, const int p_set_pid_env, const char *escaped_sockpath, const pid_t pid)
 {
     switch (opt_sh) {
         case C_SH:
-            printf("setenv SSH_AUTH_SOCK %s;\n", escaped_sockpath);
+            fprintf(out, "setenv SSH_AUTH_SOCK %s;\n", escaped_sockpath);
             if (p_set_pid_env)
-                printf("setenv SSH_AGENT_PID %d;\n", pid);
+                fprintf(out, "setenv SSH_AGENT_PID %d;\n", pid);
             break;
         case BOURNE:
-            printf("SSH_AUTH_SOCK=%s; export SSH_AUTH_SOCK;\n", escaped_sockpath);
+            fprintf(out, "SSH_AUTH_SOCK=%s; export SSH_AUTH_SOCK;\n", escaped_sockpath);
             if (p_set_pid_env)
-                printf("SSH_AGENT_PID=%d; export SSH_AGENT_PID;\n", pid);
+                fprintf(out, "SSH_AGENT_PID=%d; export SSH_AGENT_PID;\n", pid);
             break;
         case FISH:
-            printf("set -x SSH_AUTH_SOCK %s;\n", escaped_sockpath);
+            fprintf(out, "set -x SSH_AUTH_SOCK %s;\n", escaped_sockpath);
             if (p_set_pid_env)
-                printf("set -x SSH_AGENT_PID %d;\n", pid);
+                fprintf(out, "set -x SSH_AGENT_PID %d;\n", pid);
             break;
         case UNKNOWN:
             break;
     }
 }
 
+
+// Write the environment for every shell flavour next to each other, each one
+// through a temporary file and rename(), so that a shell sourcing it while an
+// agent starts never sees a partial file.
+static void
+write_env_files(const char *path, const char *sockpath, pid_t pid)
+{
+    static const shell_type shells[] = { BOURNE, C_SH, FISH };
+    char dstpath[PATH_MAX + 8], tmppath[PATH_MAX + 16];
+    char *escaped_sockpath;
+    size_t i;
+
+    escaped_sockpath = shell_escape(sockpath);
+    if (!escaped_sockpath) {
+        warn("shell_escape");
+        return;
+    }
+    for (i = 0; i < sizeof(shells) / sizeof(shells[0]); ++i) {
+        FILE *out;
+        int fd;
+
+        snprintf(dstpath, sizeof(dstpath), "%s%s", path, env_file_suffix[i]);
+        snprintf(tmppath, sizeof(tmppath), "%s.tmp", dstpath);
+        fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+            warn("open(%s)", tmppath);
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        output_set_env(out, shells[i], 1, escaped_sockpath, pid);
+        if (fclose(out) != 0 || rename(tmppath, dstpath) < 0) {
+            warn("write env file %s", dstpath);
+            unlink(tmppath);
+        }
+    }
+    free(escaped_sockpath);
+}
+
+// Parse a time as ssh-agent -t does: seconds, or a sequence of numbers each
+// followed by s, m, h, d or w, as in 1h30m. Returns -1 if it is not one.
+static long
+parse_time(const char *s)
+{
+    long total = 0;
+
+    if (*s == '\0')
+        return -1;
+    while (*s) {
+        char *end;
+        long n, unit;
+
+        if (*s < '0' || *s > '9')
+            return -1;
+        errno = 0;
+        n = strtol(s, &end, 10);
+        if (errno == ERANGE)
+            return -1;
+        switch (*end) {
+            case '\0': unit = 1; break;
+            case 's': case 'S': unit = 1; ++end; break;
+            case 'm': case 'M': unit = 60; ++end; break;
+            case 'h': case 'H': unit = 60 * 60; ++end; break;
+            case 'd': case 'D': unit = 24 * 60 * 60; ++end; break;
+            case 'w': case 'W': unit = 7 * 24 * 60 * 60; ++end; break;
+            default: return -1;
+        }
+        if (n > (INT_MAX - total) / unit)
+            return -1;
+        total += n * unit;
+        s = end;
+    }
+    return total;
+}
+
 static shell_type
 parse_shell_option(const char *shell_name)
 {
@@ -752,23 +3663,64 @@ main(int argc, char *argv[])
         { "version", no_argument, 0, 'v' },
         { "reuse", no_argument, 0, 'r' },
         { "helper", required_argument, 0, 'H' },
+        { "upgrade", no_argument, 0, 'U' },
+        { "drain-timeout", required_argument, 0, OPT_DRAIN_TIMEOUT },
+        { "upgrade-fd", required_argument, 0, OPT_UPGRADE_FD },
+        { "shared", no_argument, 0, OPT_SHARED },
+        { "listen", required_argument, 0, 'L' },
+        { "view", required_argument, 0, OPT_VIEW },
+        { "cache-ttl", required_argument, 0, OPT_CACHE_TTL },
+        { "probe-timeout", required_argument, 0, OPT_PROBE_TIMEOUT },
+        { "env-file", required_argument, 0, OPT_ENV_FILE },
+        { "idle-timeout", required_argument, 0, OPT_IDLE_TIMEOUT },
+        { "helper-idle", required_argument, 0, OPT_HELPER_IDLE },
+        { "prewarm", no_argument, 0, OPT_PREWARM },
+        { "client-timeout", required_argument, 0, OPT_CLIENT_TIMEOUT },
+        { "max-clients", required_argument, 0, OPT_MAX_CLIENTS },
+        { "max-queue", required_argument, 0, OPT_MAX_QUEUE },
+        { "interactive-weight", required_argument, 0, OPT_INTERACTIVE_WEIGHT },
+        { "workers", required_argument, 0, OPT_WORKERS },
+        { "io-uring", no_argument, 0, OPT_IO_URING },
+        { "splice", no_argument, 0, OPT_SPLICE },
+        { "batch", required_argument, 0, OPT_BATCH },
+        { "upstream", required_argument, 0, OPT_UPSTREAM },
+        { "keep-helper", no_argument, 0, OPT_KEEP_HELPER },
+        { "local-keys", required_argument, 0, OPT_LOCAL_KEYS },
+        { "relay", required_argument, 0, OPT_RELAY },
+        { "hedge", no_argument, 0, OPT_HEDGE },
+        { "hedge-sign", no_argument, 0, OPT_HEDGE_SIGN },
+        { "prefetch", no_argument, 0, OPT_PREFETCH },
         { 0, 0, 0, 0 }
     };
 
-    int sockfd = -1;
-
     int opt;
     int opt_quiet = 0;
     int opt_kill = 0;
+    int opt_upgrade = 0;
+    int upgrade_fd = -1;
     int opt_reuse = 0;
+    int opt_shared = 0;
+    int lock_fd = -1;
+    char shared_dir[PATH_MAX] = "";
+    char shared_pidpath[PATH_MAX] = "";
     int opt_lifetime = 0;
+    int opt_local_keys = 0;
+    const char *opt_env_file = NULL;
+    const char *opt_upstreams[MAX_BACKENDS];
+    int nupstreams = 0;
+    const char *opt_relay = NULL;
+    int helper_at = -1;  // place of the helper among the upstream agents with --keep-helper
     char exec_dir[PATH_MAX];
     ssize_t exec_dir_len;
     shell_type opt_sh = get_shell_guess();
 
+    saved_argc = argc;
+    saved_argv = argv;
+
     exec_dir_len = readlink("/proc/self/exe", exec_dir, PATH_MAX - 1);
     if (exec_dir_len > 0) {
         exec_dir[exec_dir_len] = 0;
+        strcpy(self_exe_path, exec_dir);
         strcpy(exec_dir, dirname(exec_dir));
     }
     else {
@@ -778,7 +3730,7 @@ main(int argc, char *argv[])
     // Assume that the helper binary is next to the main executable
     snprintf(win32_helper_path, PATH_MAX, "%s/%s", exec_dir, "pipe-connector.exe");
 
-    while ((opt = getopt_long(argc, argv, "+hvcsS:kdqa:rt:H:b",
+    while ((opt = getopt_long(argc, argv, "+hvcsS:kUdqa:L:rt:H:b",
                               long_options, NULL)) != -1)
         switch (opt) {
             case 'h':
@@ -790,13 +3742,67 @@ main(int argc, char *argv[])
                 printf("  -s             Generate Bourne shell commands on stdout.\n");
                 printf("  -S SHELL       Generate shell command for \"bourne\", \"csh\", or \"fish\".\n");
                 printf("  -k             Kill the current %s.\n", program_invocation_short_name);
+                printf("  -U, --upgrade  Make the current %s re-execute its binary, keeping the socket.\n", program_invocation_short_name);
                 printf("  -d             Enable debug mode.\n");
                 printf("  -q             Enable quiet mode.\n");
-                printf("  -a SOCKET      Create socket on a specific path.\n");
+                printf("  -a SOCKET      Create socket on a specific path (@NAME for an abstract socket).\n");
+                printf("  -L, --listen SOCKET\n");
+                printf("                 Also listen on SOCKET, may be repeated.\n");
+                printf("      --view FILE\n");
+                printf("                 Only allow the public keys listed in FILE on the last socket given.\n");
+                printf("      --client-timeout SECS\n");
+                printf("                 Close connections which make no progress for SECS seconds (default: 0, never).\n");
+                printf("      --max-clients N\n");
+                printf("                 Close the longest idle connection to accept more than N (default: 0, no limit).\n");
+                printf("      --max-queue N\n");
+                printf("                 Fail requests at once while N are waiting for the helper (default: 0, no limit).\n");
+                printf("      --interactive-weight N\n");
+                printf("                 Share of the helper of a terminal's foreground process, relative to\n");
+                printf("                 other processes (1 to 8, default: %d).\n", opt_interactive_weight);
+                printf("      --workers N\n");
+                printf("                 Serve connections from N threads, each with its own helper (default: 0).\n");
+                printf("      --io-uring Batch socket and helper I/O through io_uring where the kernel supports it.\n");
+                printf("      --splice   Pass large requests and replies between socket and helper with splice().\n");
+                printf("      --batch N  Pass up to N queued requests to the helper in one write (1 to %d, default: 1).\n", MAX_BATCH);
+                printf("      --cache-ttl SECS\n");
+                printf("                 Reuse the list of identities for SECS seconds (default: 0, off).\n");
                 printf("  -b             Do not exit when tty closes (only use on Windows 10 version 1809 and newer).\n");
                 printf("  -r, --reuse    Allow to reuse an existing -a SOCKET.\n");
+                printf("      --probe-timeout MS\n");
+                printf("                 Replace a reused agent which does not answer in MS milliseconds, unless it\n");
+                printf("                 is busy with a request for less than %d seconds (default: %d, 0 to only\n",
+                       BUSY_STUCK_MS / 1000, opt_probe_timeout);
+                printf("                 check that it accepts connections).\n");
                 printf("  -H, --helper   Path to the Win32 helper binary (default: %s).\n", win32_helper_path);
-                printf("  -t TIME        Limit key lifetime in seconds (not supported by Windows port of ssh-agent).\n");
+                printf("      --upstream SOCKET\n");
+                printf("                 Forward requests to the agent on SOCKET instead of the Win32 helper. May be\n");
+                printf("                 repeated to merge the keys of several agents, listed in this order.\n");
+                printf("      --keep-helper\n");
+                printf("                 Merge the keys of the Win32 helper with those of --upstream agents, in the\n");
+                printf("                 place of this option among them.\n");
+                printf("      --relay SOCKET\n");
+                printf("                 Reach the Windows agent through a relay listening on SOCKET, a path on DrvFs,\n");
+                printf("                 rather than a helper of this agent's own. The relay is started if needed.\n");
+                printf("      --hedge    Send a listing which takes longer than 95%% of the recent ones to an --upstream\n");
+                printf("                 or --relay agent again over another connection, and take the first reply.\n");
+                printf("      --hedge-sign\n");
+                printf("                 Hedge signing requests as well.\n");
+                printf("      --local-keys all|lifetime\n");
+                printf("                 Keep keys added from WSL in the agent itself rather than the Windows agent:\n");
+                printf("                 all of them, or only those added with a lifetime (ssh-add -t).\n");
+                printf("      --helper-idle SECS\n");
+                printf("                 Stop the helper after SECS seconds without requests (default: 0, never).\n");
+                printf("      --prewarm  Start the helper when a client connects rather than on its first request.\n");
+                printf("      --prefetch Ask for the identities when a client connects, unless --cache-ttl has them.\n");
+                printf("  -t TIME        Default lifetime of --local-keys, in seconds or as 1h30m (not supported by\n");
+                printf("                 Windows port of ssh-agent).\n");
+                printf("      --shared   Use (and start if needed) a single agent for all shells of the user.\n");
+                printf("      --env-file FILE\n");
+                printf("                 Also write the environment to FILE, FILE.csh and FILE.fish.\n");
+                printf("      --idle-timeout SECS\n");
+                printf("                 Exit after SECS seconds without connections (default: 0, never).\n");
+                printf("      --drain-timeout SECS\n");
+                printf("                 Time to finish in-flight requests on SIGTERM (default: %d).\n", opt_drain_timeout);
                 return 0;
 
             case 'v':
@@ -826,6 +3832,10 @@ main(int argc, char *argv[])
                 opt_kill = 1;
                 break;
 
+            case 'U':
+                opt_upgrade = 1;
+                break;
+
             case 'd':
                 opt_debug = 1;
                 break;
@@ -840,12 +3850,111 @@ main(int argc, char *argv[])
                 strcpy(sockpath, optarg);
                 break;
 
+            case 'L':
+                if (nlisteners == MAX_LISTENERS)
+                    errx(1, "too many sockets, at most %d are supported", MAX_LISTENERS);
+                if (strlen(optarg) + 1 > sizeof(listeners[0].path))
+                    errx(1, "socket address is too long");
+                listeners[nlisteners++].name = optarg;
+                break;
+
+            case OPT_VIEW:
+                // Applies to the last socket declared so far
+                listeners[nlisteners - 1].view_name = optarg;
+                break;
+
+            case OPT_PROBE_TIMEOUT:
+                opt_probe_timeout = atoi(optarg);
+                if (opt_probe_timeout < 0)
+                    errx(1, "invalid probe timeout \"%s\"", optarg);
+                break;
+
+            case OPT_CLIENT_TIMEOUT:
+                opt_client_timeout = atoi(optarg);
+                if (opt_client_timeout < 0)
+                    errx(1, "invalid client timeout \"%s\"", optarg);
+                break;
+
+            case OPT_MAX_CLIENTS:
+                opt_max_clients = atoi(optarg);
+                if (opt_max_clients < 0)
+                    errx(1, "invalid connection limit \"%s\"", optarg);
+                break;
+
+            case OPT_WORKERS:
+                opt_workers = atoi(optarg);
+                if (opt_workers < 0 || opt_workers > 64)
+                    errx(1, "invalid number of workers \"%s\"", optarg);
+                break;
+
+            case OPT_BATCH:
+                opt_batch = atoi(optarg);
+                if (opt_batch < 1 || opt_batch > MAX_BATCH)
+                    errx(1, "invalid batch size \"%s\"", optarg);
+                break;
+
+            case OPT_SPLICE:
+                opt_splice = 1;
+                break;
+
+            case OPT_IO_URING:
+#if HAVE_IO_URING
+                opt_io_uring = 1;
+#else
+                warnx("built without io_uring support, ignoring --io-uring");
+#endif
+                break;
+
+            case OPT_INTERACTIVE_WEIGHT:
+                opt_interactive_weight = atoi(optarg);
+                if (opt_interactive_weight < 1 || opt_interactive_weight > 8)
+                    errx(1, "invalid interactive weight \"%s\"", optarg);
+                break;
+
+            case OPT_MAX_QUEUE:
+                opt_max_queue = atoi(optarg);
+                if (opt_max_queue < 0)
+                    errx(1, "invalid queue limit \"%s\"", optarg);
+                break;
+
+            case OPT_HELPER_IDLE:
+                opt_helper_idle = atoi(optarg);
+                if (opt_helper_idle < 0)
+                    errx(1, "invalid helper idle timeout \"%s\"", optarg);
+                break;
+
+            case OPT_PREWARM:
+                opt_prewarm = 1;
+                break;
+
+            case OPT_PREFETCH:
+                opt_prefetch = 1;
+                break;
+
+            case OPT_IDLE_TIMEOUT:
+                opt_idle_timeout = atoi(optarg);
+                if (opt_idle_timeout < 0)
+                    errx(1, "invalid idle timeout \"%s\"", optarg);
+                break;
+
+            case OPT_ENV_FILE:
+                opt_env_file = optarg;
+                break;
+
+            case OPT_CACHE_TTL:
+                opt_cache_ttl = atoi(optarg);
+                if (opt_cache_ttl < 0)
+                    errx(1, "invalid cache ttl \"%s\"", optarg);
+                break;
+
             case 'r':
                 opt_reuse = 1;
                 break;
 
             case 't':
-                opt_lifetime = 1;
+                opt_lifetime = (int)parse_time(optarg);
+                if (opt_lifetime <= 0)
+                    errx(1, "invalid lifetime \"%s\"", optarg);
                 break;
 
             case 'H':
@@ -853,10 +3962,69 @@ main(int argc, char *argv[])
                     err(1, "invalid helper path (use --helper to specify the Win32 helper path)");
                 break;
 
+            case OPT_UPSTREAM:
+                if (nupstreams + (helper_at >= 0) == MAX_BACKENDS)
+                    errx(1, "too many backends, at most %d are supported", MAX_BACKENDS);
+                if (strlen(optarg) + 1 > sizeof(((struct sockaddr_un *)0)->sun_path))
+                    errx(1, "upstream socket address is too long");
+                opt_upstreams[nupstreams++] = optarg;
+                break;
+
+            case OPT_KEEP_HELPER:
+                if (helper_at < 0 && nupstreams == MAX_BACKENDS)
+                    errx(1, "too many backends, at most %d are supported", MAX_BACKENDS);
+                if (helper_at < 0)
+                    helper_at = nupstreams;
+                break;
+
+            case OPT_RELAY:
+                if (optarg[0] != '/')
+                    errx(1, "relay socket path must be absolute");
+                if (strlen(optarg) + 1 > sizeof(((struct sockaddr_un *)0)->sun_path))
+                    errx(1, "relay socket address is too long");
+                opt_relay = optarg;
+                break;
+
+            case OPT_HEDGE:
+                opt_hedge |= HEDGE_READ;
+                break;
+
+            case OPT_HEDGE_SIGN:
+                opt_hedge |= HEDGE_READ | HEDGE_SIGN;
+                break;
+
+            case OPT_LOCAL_KEYS:
+                if (!strcmp(optarg, "all"))
+                    opt_local_keys = KEYSTORE_ALL;
+                else if (!strcmp(optarg, "lifetime"))
+                    opt_local_keys = KEYSTORE_LIFETIME;
+                else
+                    errx(1, "invalid --local-keys \"%s\", use all or lifetime", optarg);
+#if !HAVE_OPENSSL
+                warnx("built without OpenSSL, ignoring --local-keys");
+                opt_local_keys = 0;
+#endif
+                break;
+
             case 'b':
                 opt_no_exit = 1;
                 break;
 
+            case OPT_DRAIN_TIMEOUT:
+                opt_drain_timeout = atoi(optarg);
+                if (opt_drain_timeout < 0)
+                    errx(1, "invalid drain timeout \"%s\"", optarg);
+                break;
+
+            case OPT_SHARED:
+                opt_shared = 1;
+                break;
+
+            case OPT_UPGRADE_FD:
+                // Internal, passed by the previous binary to the new one on --upgrade
+                upgrade_fd = atoi(optarg);
+                break;
+
             case '?':
                 errx(1, "try --help for more information");
                 break;
@@ -892,6 +4060,33 @@ main(int argc, char *argv[])
         return 0;
     }
 
+    if (opt_upgrade) {
+        pid_t pid;
+        const char *pidenv = getenv("SSH_AGENT_PID");
+        if (!pidenv)
+            errx(1, "SSH_AGENT_PID not set, cannot upgrade agent");
+        pid = atoi(pidenv);
+        if (kill(pid, SIGUSR2) < 0)
+            err(1, "kill(%d)", pid);
+        if (!opt_quiet)
+            printf("echo ssh-agent-wsl pid %d upgraded;\n", pid);
+        return 0;
+    }
+
+    if (opt_shared) {
+        // Well-known per-user socket, implies --reuse
+        if (sockpath[0])
+            errx(1, "-a cannot be combined with --shared");
+        prepare_shared_dir(shared_dir, sizeof(shared_dir));
+
+        // The socket path must also fit in a sockaddr_un
+        if (snprintf(sockpath, sizeof(sockpath), "%s/agent.sock", shared_dir) >= (int)sizeof(sockpath) ||
+            strlen(sockpath) >= sizeof(((struct sockaddr_un *)NULL)->sun_path) ||
+            snprintf(shared_pidpath, sizeof(shared_pidpath), "%s/agent.pid", shared_dir) >= (int)sizeof(shared_pidpath))
+            errx(1, "shared directory path %s is too long", shared_dir);
+        opt_reuse = 1;
+    }
+
     if (opt_reuse && !sockpath[0])
     {
         // If a fixed socket path was not specified, check if there is
@@ -904,30 +4099,153 @@ main(int argc, char *argv[])
         }
     }
 
-    if (opt_lifetime && !opt_quiet)
+    if (opt_lifetime && !opt_local_keys && !opt_quiet)
         warnx("option is not supported by Windows port of ssh-agent -- t");
 
-    // Preflight the helper path
-    if (access(win32_helper_path, X_OK) < 0)
-        errx(1, "file %s is not an executable; use --helper to specify the Win32 helper path", win32_helper_path);
+    struct backend *helper = &win32_backend;
+    if (opt_relay && nupstreams > 0 && helper_at < 0)
+        warnx("--relay is only used with --keep-helper alongside --upstream, ignoring it");
+    else if (opt_relay) {
+        struct sockaddr_un addr;
+        socklen_t addrlen = socket_address(opt_relay, &addr);
+
+        if ((helper = upstream_new(opt_relay, &addr, addrlen)) == NULL)
+            exit(1);
+        upstream_set_spawn(helper, start_win32_relay);
+        backends[0] = helper;
+    }
+    if (nupstreams > 0) {
+        nbackends = 0;
+        for (int i = 0; i <= nupstreams; ++i) {
+            struct sockaddr_un addr;
+            socklen_t addrlen;
+
+            if (i == helper_at)
+                backends[nbackends++] = helper;
+            if (i == nupstreams)
+                break;
+            addrlen = socket_address(opt_upstreams[i], &addr);
+            if ((backends[nbackends++] = upstream_new(opt_upstreams[i], &addr, addrlen)) == NULL)
+                exit(1);
+        }
+    }
+    if (opt_hedge && nupstreams == 0 && !opt_relay) {
+        // A helper answers one request at a time, there is nothing to hedge with
+        warnx("--hedge only works with --upstream or --relay agents, ignoring it");
+        opt_hedge = 0;
+    }
+    upstream_set_hedging(opt_hedge);
+#if HAVE_OPENSSL
+    if (opt_local_keys) {
+        // First, so that its keys are listed (and signed with) before the
+        // same keys elsewhere
+        if (nbackends == MAX_BACKENDS)
+            errx(1, "too many backends, at most %d are supported", MAX_BACKENDS);
+        if ((local_backend = keystore_init(opt_local_keys, (uint32_t)opt_lifetime)) == NULL)
+            exit(1);
+        memmove(backends + 1, backends, nbackends * sizeof(*backends));
+        backends[0] = local_backend;
+        ++nbackends;
+        default_backend = 1;
+    }
+#endif
+    if (opt_splice && (nbackends > 1 || backends[0] != &win32_backend)) {
+        // splice() needs a pipe on one side, there is none
+        warnx("--splice only works with the Win32 helper alone, ignoring it");
+        opt_splice = 0;
+    }
 
     signal(SIGINT, cleanup_signal);
     signal(SIGHUP, cleanup_signal);
     signal(SIGTERM, cleanup_signal);
+    signal(SIGUSR2, upgrade_signal);
+    signal(SIGUSR1, stats_signal);
     signal(SIGPIPE, SIG_IGN);
 
-    int p_sock_reused = opt_reuse && reuse_socket_path(sockpath);
+    for (int i = 0; i < nlisteners; ++i) {
+        listeners[i].fd = -1;
+        if (listeners[i].view_name && (listeners[i].view = key_view_load(listeners[i].view_name)) == NULL)
+            errx(1, "cannot load key view %s", listeners[i].view_name);
+    }
+
+    if (upgrade_fd >= 0) {
+        // Started by the previous binary on --upgrade: we already are the
+        // daemon, just take over its sockets and clients.
+        struct inherited_client clients[FD_SETSIZE];
+        int nclients;
+        inherited_children = 1;
+        signal(SIGCHLD, cleanup_signal);
+        receive_upgrade(upgrade_fd, sockpath, sizeof(sockpath), clients, &nclients);
+        if (opt_env_file)
+            snprintf(cleanup_envpath, sizeof(cleanup_envpath), "%s", opt_env_file);
+        do_agent_loop(clients, nclients);
+    }
+
+    // Started by a service manager which owns the sockets: no socket to
+    // create or reuse, nothing to print and no terminal to watch.
+    int p_activated = inherit_listen_fds(sockpath, sizeof(sockpath)) > 0;
+    if (p_activated) {
+        opt_reuse = opt_shared = 0;
+        opt_no_exit = tty_gone = 1;
+    }
+
+    int p_sock_reused = opt_reuse && reuse_socket_path(sockpath, shared_pidpath);
+    if (!p_sock_reused && opt_shared) {
+        // Nobody answered on the shared socket. Serialize the startup, so that
+        // shells started at the same time end up with a single agent: whoever
+        // gets the lock second finds the socket of the first one.
+        lock_fd = lock_shared_dir(shared_dir);
+        p_sock_reused = reuse_socket_path(sockpath, shared_pidpath);
+    }
     if (!p_sock_reused) {
-        if (!sockpath[0] || sockpath_from_env)
-            create_socket_path(sockpath, sizeof(sockpath));
-        sockfd = open_auth_socket(sockpath);
+        // The upstream agents may well be started later, but not be us
+        for (int u = 0; u < nupstreams; ++u) {
+            for (int i = 0; i < nlisteners; ++i) {
+                if (!strcmp(opt_upstreams[u], i == 0 ? sockpath : listeners[i].name)) {
+                    warnx("--upstream %s is a socket of this agent", opt_upstreams[u]);
+                    cleanup_exit(1);
+                }
+            }
+            if (opt_upstreams[u][0] != '@' && !path_is_socket(opt_upstreams[u]))
+                warnx("upstream socket %s does not exist yet", opt_upstreams[u]);
+        }
+
+        // Preflight the helper path, a relay which is running already does
+        // without it
+        if ((nupstreams == 0 || helper_at >= 0) && !(opt_relay && path_is_socket(opt_relay)) &&
+            access(win32_helper_path, X_OK) < 0) {
+            warnx("file %s is not an executable; use --helper to specify the Win32 helper path", win32_helper_path);
+            cleanup_exit(1);
+        }
+
+        if (!p_activated) {
+            if (!sockpath[0] || sockpath_from_env)
+                create_socket_path(sockpath, sizeof(sockpath));
+            listeners[0].fd = open_auth_socket(sockpath, listeners[0].path);
+            for (int i = 1; i < nlisteners; ++i)
+                listeners[i].fd = open_auth_socket(listeners[i].name, listeners[i].path);
+        }
+        if (opt_shared)
+            strcpy(cleanup_pidpath, shared_pidpath);
+        if (opt_env_file)
+            snprintf(cleanup_envpath, sizeof(cleanup_envpath), "%s", opt_env_file);
     }
 
     // If the sockpath is actually reused, don't daemonize, don't set
-    // SSH_AGENT_PID, and don't go into do_agent_loop(). Just set
-    // SSH_AUTH_SOCK and exit normally.
-    int p_daemonize = !(opt_debug || p_sock_reused);
+    // SSH_AGENT_PID (unless the shared agent has told us its pid), and don't
+    // go into do_agent_loop(). Just set SSH_AUTH_SOCK and exit normally.
+    int p_daemonize = !(opt_debug || p_sock_reused || p_activated);
     int p_set_pid_env = !p_sock_reused;
+    pid_t shared_pid = 0;
+    if (p_sock_reused && opt_shared) {
+        // The agent may be listening already while its starter still holds
+        // the lock to write the pid file, wait for it in that case.
+        if ((shared_pid = read_pid_file(shared_pidpath)) <= 0 && lock_fd < 0) {
+            lock_fd = lock_shared_dir(shared_dir);
+            shared_pid = read_pid_file(shared_pidpath);
+        }
+        p_set_pid_env = shared_pid > 0;
+    }
 
     if (optind < argc) {
         // Subcommand exeuction mode
@@ -955,6 +4273,13 @@ main(int argc, char *argv[])
             cleanup_warn(subargv[0]);
 
         posix_spawnattr_destroy(&sp_attr);
+
+        if (opt_shared && !p_sock_reused)
+            write_pid_file(shared_pidpath, getpid());
+        if (opt_env_file && !p_sock_reused)
+            write_env_files(opt_env_file, sockpath, getpid());
+        if (lock_fd >= 0)
+            close(lock_fd);
     }
     else {
         // Daemon mode
@@ -969,13 +4294,32 @@ main(int argc, char *argv[])
 
         if (pid < 0)
             cleanup_warn("fork");
+        if (pid == 0) {
+            if (lock_fd >= 0)
+                close(lock_fd);  // the parent drops the lock once the pid file is written
+            // Listen again, so that SO_PEERCRED on client sockets names the
+            // daemon rather than the process which started it.
+            for (int i = 0; i < nlisteners; ++i)
+                listen(listeners[i].fd, 128);
+        }
         if (pid > 0) {
+            if (opt_shared && !p_sock_reused)
+                write_pid_file(shared_pidpath, pid);
+            if (opt_env_file && !p_sock_reused)
+                write_env_files(opt_env_file, sockpath, pid);
+            // Once the pid file is in place, the next shell may go ahead
+            if (lock_fd >= 0)
+                close(lock_fd);
+            if (shared_pid > 0)
+                pid = shared_pid;
+
             char *escaped_sockpath = shell_escape(sockpath);
             if (!escaped_sockpath)
                 cleanup_warn("shell_escape");
-            output_set_env(opt_sh, p_set_pid_env, escaped_sockpath, pid);
+            if (!p_activated)
+                output_set_env(stdout, opt_sh, p_set_pid_env, escaped_sockpath, pid);
             free(escaped_sockpath);
-            if (p_set_pid_env && !opt_quiet)
+            if (p_set_pid_env && !p_sock_reused && !p_activated && !opt_quiet)
                 if (!strcasecmp((const char *)program_invocation_short_name, "ssh-agent")) {
                     // Make sure output is compatible with openssh
                     printf("echo Agent pid %d;\n", pid);
@@ -997,7 +4341,7 @@ main(int argc, char *argv[])
         // Detach from process group but not the session to keep the controlling
         // tty but avoid receiving the foreground process group's signals. See
         // comments for check_tty_gone on why these tricks are needed.
-        else if (setpgid(0, 0) < 0)
+        else if (!p_activated && setpgid(0, 0) < 0)
             cleanup_warn("setpgid");
         else
             // Set up SIGCHLD handler to catch the helper process exiting
@@ -1016,7 +4360,7 @@ main(int argc, char *argv[])
     int status = 0;
     if (!p_sock_reused)
         // Run main loop and wait for agent connections
-        do_agent_loop(sockfd);
+        do_agent_loop(NULL, 0);
     else if (subcommand_pid > 0)
         // Reused socket in subcommand mode: 
         status = wait_subcommand(0);
@@ -0,0 +1,553 @@
+/*
+ * ssh-agent-wsl stand-in for the Win32 helper, to exercise the daemon on
+ * Linux.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// Started by the daemon with -H in place of pipe-connector.exe, this speaks
+// the same protocol on stdin/stdout (or on a relay socket with --relay NAME)
+// and answers from a key set loaded at start or from a local agent. Since the
+// daemon passes its own arguments, the rest is set in the environment:
+//
+//   PIPE_STANDIN_KEYS=FILE  keys to list and sign with, as in .pub files
+//   PIPE_STANDIN_AGENT=SOCKET  forward requests to this agent instead
+//   PIPE_STANDIN_DELAY=fixed:MS | uniform:MIN:MAX | exp:MEAN | bimodal:FAST:SLOW:P
+//   PIPE_STANDIN_HANG=P  never answer
+//   PIPE_STANDIN_CRASH=P  exit without answering
+//   PIPE_STANDIN_PARTIAL=P  write the reply in pieces, with pauses between
+//   PIPE_STANDIN_BUSY=P  fail as pipe-connector does when the pipe is busy
+//   PIPE_STANDIN_SEED=N  for the random choices above, with the process id so
+//       that a helper restarted after a crash does not crash the same way
+//
+// P is the probability per request. Signatures from the key set are not real
+// ones, and the set cannot be changed: other requests fail.
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+#include "keyview.h"
+
+// pipe-connector gives up on a busy pipe after this long
+#define BUSY_TIMEOUT_MS 1000
+
+// Between the pieces of a partial reply
+#define PARTIAL_PAUSE_MS 5
+
+#define CRASH_STATUS 3
+
+enum delay {
+    DELAY_NONE,
+    DELAY_FIXED,
+    DELAY_UNIFORM,
+    DELAY_EXP,
+    DELAY_BIMODAL,
+};
+
+static struct {
+    enum delay delay;
+    double a, b, p;  // parameters of the delay, ms, and p for bimodal
+    double hang, crash, partial, busy;
+    const char *agent;
+    struct key_view *keys;
+    uint8_t *identities;  // answer listing keys
+    unsigned long seed;
+} conf;
+
+static int debug;
+
+// Per connection to the daemon
+struct session {
+    unsigned short xsubi[3];
+    int agent_fd;
+};
+
+
+static void
+debug_print(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!debug)
+        return;
+    va_start(ap, fmt);
+    vwarnx(fmt, ap);
+    va_end(ap);
+}
+
+
+static void
+sleep_ms(double ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+static double
+env_probability(const char *name)
+{
+    const char *value = getenv(name);
+    char *end;
+    double p;
+
+    if (value == NULL || *value == '\0')
+        return 0;
+    p = strtod(value, &end);
+    if (*end != '\0' || !(p >= 0 && p <= 1))
+        errx(1, "%s must be a probability from 0 to 1, not %s", name, value);
+    return p;
+}
+
+
+static void
+parse_delay(const char *value)
+{
+    char c;
+
+    if (value == NULL || *value == '\0')
+        conf.delay = DELAY_NONE;
+    else if (sscanf(value, "fixed:%lf%c", &conf.a, &c) == 1)
+        conf.delay = DELAY_FIXED;
+    else if (sscanf(value, "uniform:%lf:%lf%c", &conf.a, &conf.b, &c) == 2 && conf.a <= conf.b)
+        conf.delay = DELAY_UNIFORM;
+    else if (sscanf(value, "exp:%lf%c", &conf.a, &c) == 1)
+        conf.delay = DELAY_EXP;
+    else if (sscanf(value, "bimodal:%lf:%lf:%lf%c", &conf.a, &conf.b, &conf.p, &c) == 3 &&
+             conf.p >= 0 && conf.p <= 1)
+        conf.delay = DELAY_BIMODAL;
+    else
+        errx(1, "bad PIPE_STANDIN_DELAY %s", value);
+    if (conf.a < 0 || conf.b < 0)
+        errx(1, "bad PIPE_STANDIN_DELAY %s", value);
+}
+
+
+static double
+draw_delay(struct session *s)
+{
+    switch (conf.delay) {
+    case DELAY_FIXED:
+        return conf.a;
+    case DELAY_UNIFORM:
+        return conf.a + (conf.b - conf.a) * erand48(s->xsubi);
+    case DELAY_EXP:
+        return -conf.a * log(1 - erand48(s->xsubi));
+    case DELAY_BIMODAL:
+        return erand48(s->xsubi) < conf.p ? conf.b : conf.a;
+    default:
+        return 0;
+    }
+}
+
+
+static int
+chance(struct session *s, double p)
+{
+    return p > 0 && erand48(s->xsubi) < p;
+}
+
+
+static void
+session_init(struct session *s, unsigned long n)
+{
+    unsigned long seed = conf.seed + n * 0x9e3779b9UL;
+
+    s->xsubi[0] = (unsigned short)seed;
+    s->xsubi[1] = (unsigned short)(seed >> 16);
+    s->xsubi[2] = (unsigned short)(n ^ 0x330e);
+    s->agent_fd = -1;
+}
+
+
+// Build the identities answer of the key set
+static void
+load_keys(const char *path)
+{
+    static const char comment[] = "pipe-standin";
+    size_t len = 9, i;
+    uint8_t *p;
+
+    if ((conf.keys = key_view_load(path)) == NULL)
+        exit(1);
+    for (i = 0; i < conf.keys->nkeys; ++i)
+        len += 8 + conf.keys->keys[i].len + strlen(comment);
+    if (len > AGENT_MAX_MSGLEN)
+        errx(1, "too many keys in %s", path);
+    if ((conf.identities = malloc(len)) == NULL)
+        err(1, "malloc");
+
+    p = conf.identities;
+    put_u32(p, (uint32_t)len - 4);
+    p[4] = SSH_AGENT_IDENTITIES_ANSWER;
+    put_u32(p + 5, (uint32_t)conf.keys->nkeys);
+    p += 9;
+    for (i = 0; i < conf.keys->nkeys; ++i) {
+        put_u32(p, conf.keys->keys[i].len);
+        memcpy(p + 4, conf.keys->keys[i].data, conf.keys->keys[i].len);
+        p += 4 + conf.keys->keys[i].len;
+        put_u32(p, (uint32_t)strlen(comment));
+        memcpy(p + 4, comment, strlen(comment));
+        p += 4 + strlen(comment);
+    }
+    debug_print("loaded %zu keys from %s", conf.keys->nkeys, path);
+}
+
+
+static void
+reply_failure(uint8_t *buf)
+{
+    frame_put_header(buf, 1);
+    buf[4] = SSH_AGENT_FAILURE;
+}
+
+
+// A signature of the key's type over nothing: well formed, not valid
+static void
+answer_sign(uint8_t *buf)
+{
+    const uint8_t *blob;
+    uint32_t len, type_len;
+
+    if (agent_sign_request_key(buf, &blob, &len) < 0 || !key_view_contains(conf.keys, blob, len) ||
+        len < 4 || (type_len = get_u32(blob)) > len - 4) {
+        reply_failure(buf);
+        return;
+    }
+
+    // blob may point into buf
+    uint8_t type[256];
+    if (type_len > sizeof(type)) {
+        reply_failure(buf);
+        return;
+    }
+    memcpy(type, blob + 4, type_len);
+
+    frame_put_header(buf, 1 + 4 + 4 + type_len + 4 + 64);
+    buf[4] = SSH_AGENT_SIGN_RESPONSE;
+    put_u32(buf + 5, 4 + type_len + 4 + 64);
+    put_u32(buf + 9, type_len);
+    memcpy(buf + 13, type, type_len);
+    put_u32(buf + 13 + type_len, 64);
+    memset(buf + 17 + type_len, 0, 64);
+}
+
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t cnt;
+
+    while (len > 0) {
+        if ((cnt = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += cnt;
+        len -= (size_t)cnt;
+    }
+    return 0;
+}
+
+
+// Read one whole message into buf. Returns 0 on success, -1 on errors and EOF.
+static int
+read_message(int fd, uint8_t *buf)
+{
+    size_t got = 0;
+    int64_t size;
+    ssize_t cnt;
+
+    while ((size = frame_check(buf, got, AGENT_MAX_MSGLEN)) <= 0) {
+        if (size == FRAME_TOO_LONG)
+            return -1;
+        if ((cnt = read(fd, buf + got, AGENT_MAX_MSGLEN - got)) <= 0) {
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += (size_t)cnt;
+    }
+    return got == (size_t)size ? 0 : -1;
+}
+
+
+static void
+forward(struct session *s, uint8_t *buf)
+{
+    struct sockaddr_un addr;
+    uint8_t request[AGENT_MAX_MSGLEN];
+    int tries;
+
+    memcpy(request, buf, msglen(buf));
+    for (tries = 0; tries < 2; ++tries) {
+        if (s->agent_fd < 0) {
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, conf.agent, sizeof(addr.sun_path) - 1);
+            if ((s->agent_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+                break;
+            if (connect(s->agent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                warn("cannot connect to agent %s", conf.agent);
+                break;
+            }
+        }
+        if (write_all(s->agent_fd, request, msglen(request)) == 0 && read_message(s->agent_fd, buf) == 0)
+            return;
+
+        // The agent may have closed an idle connection, try a new one
+        close(s->agent_fd);
+        s->agent_fd = -1;
+    }
+    if (s->agent_fd >= 0) {
+        close(s->agent_fd);
+        s->agent_fd = -1;
+    }
+    reply_failure(buf);
+}
+
+
+// Answer the request in buf in place, or hang or crash on it.
+static void
+serve(struct session *s, uint8_t *buf)
+{
+    int type = buf[4];
+
+    if (chance(s, conf.crash)) {
+        debug_print("crashing on request %d", type);
+        _exit(CRASH_STATUS);
+    }
+    if (chance(s, conf.hang)) {
+        debug_print("hanging on request %d", type);
+        for (;;)
+            pause();
+    }
+    if (chance(s, conf.busy)) {
+        debug_print("pipe busy for request %d", type);
+        sleep_ms(BUSY_TIMEOUT_MS);
+        reply_failure(buf);
+        return;
+    }
+    sleep_ms(draw_delay(s));
+
+    if (conf.agent != NULL)
+        forward(s, buf);
+    else if (type == SSH_AGENTC_REQUEST_IDENTITIES && conf.identities != NULL)
+        memcpy(buf, conf.identities, msglen(conf.identities));
+    else if (type == SSH_AGENTC_REQUEST_IDENTITIES) {
+        frame_put_header(buf, 5);
+        buf[4] = SSH_AGENT_IDENTITIES_ANSWER;
+        put_u32(buf + 5, 0);
+    }
+    else if (type == SSH_AGENTC_SIGN_REQUEST && conf.keys != NULL)
+        answer_sign(buf);
+    else
+        reply_failure(buf);
+}
+
+
+// Write out replies, in pieces with pauses between if the session draws a
+// partial write
+static int
+send_replies(struct session *s, int fd, const uint8_t *buf, size_t len)
+{
+    size_t piece;
+
+    if (len > 1 && chance(s, conf.partial)) {
+        while (len > 0) {
+            piece = 1 + (size_t)(erand48(s->xsubi) * (double)len / 2);
+            debug_print("writing %zu of %zu bytes", piece, len);
+            if (write_all(fd, buf, piece) < 0)
+                return -1;
+            buf += piece;
+            len -= piece;
+            if (len > 0)
+                sleep_ms(PARTIAL_PAUSE_MS);
+        }
+        return 0;
+    }
+    return write_all(fd, buf, len);
+}
+
+
+// Serve stdin/stdout as pipe-connector does: requests may come several at
+// once, and their replies are written together once no more are buffered.
+static int
+pipe_main(void)
+{
+    static uint8_t in[2 * AGENT_MAX_MSGLEN], out[2 * AGENT_MAX_MSGLEN], buf[AGENT_MAX_MSGLEN];
+    struct frame_reader frames = { 0, 0 };
+    struct frame_reader peek;
+    struct session s;
+    size_t outlen = 0;
+    int64_t size;
+    ssize_t cnt;
+
+    session_init(&s, 0);
+    if (write_all(STDOUT_FILENO, (const uint8_t *)"a", 1) < 0)
+        err(1, "failed to write init byte");
+
+    for (;;) {
+        while ((size = frame_next(&frames, in, AGENT_MAX_MSGLEN)) <= 0) {
+            if (size == FRAME_TOO_LONG) {
+                warnx("got packet with length %u exceeding maximum", msglen(in + frames.start) - 4);
+                return 1;
+            }
+            if (frames.start > 0) {
+                memmove(in, in + frames.start, frames.end - frames.start);
+                frames.end -= frames.start;
+                frames.start = 0;
+            }
+            if ((cnt = read(STDIN_FILENO, in + frames.end, sizeof(in) - frames.end)) < 0 && errno == EINTR)
+                continue;
+            if (cnt <= 0) {
+                debug_print("EOF on input");
+                return 0;
+            }
+            frames.end += (size_t)cnt;
+        }
+
+        memcpy(buf, in + frames.start - (size_t)size, (size_t)size);
+        serve(&s, buf);
+
+        if (outlen + msglen(buf) > sizeof(out)) {
+            if (send_replies(&s, STDOUT_FILENO, out, outlen) < 0)
+                return 1;
+            outlen = 0;
+        }
+        memcpy(out + outlen, buf, msglen(buf));
+        outlen += msglen(buf);
+
+        peek = frames;
+        if (frame_next(&peek, in, AGENT_MAX_MSGLEN) <= 0) {
+            if (send_replies(&s, STDOUT_FILENO, out, outlen) < 0)
+                return 1;
+            outlen = 0;
+        }
+    }
+}
+
+
+static void *
+relay_client(void *arg)
+{
+    static unsigned long sessions;
+    struct session s;
+    int fd = (int)(intptr_t)arg;
+    uint8_t *buf = malloc(AGENT_MAX_MSGLEN);
+
+    session_init(&s, __atomic_add_fetch(&sessions, 1, __ATOMIC_RELAXED));
+    while (buf != NULL && read_message(fd, buf) == 0) {
+        serve(&s, buf);
+        if (send_replies(&s, fd, buf, msglen(buf)) < 0)
+            break;
+    }
+    if (s.agent_fd >= 0)
+        close(s.agent_fd);
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+
+// With --relay NAME, listen on the socket NAME in the current directory, a
+// request at a time per connection, as pipe-connector does
+static int
+relay_main(const char *name)
+{
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int listener, fd;
+
+    if (strlen(name) >= sizeof(addr.sun_path))
+        errx(1, "relay socket name %s is too long", name);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, name);
+
+    // Another daemon may have started a relay just now, leave it to that one
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        err(1, "socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        debug_print("relay already listening on %s", name);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    unlink(name);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0)
+        err(1, "cannot listen on relay socket %s", name);
+    debug_print("relay listening on %s", name);
+
+    // A daemon which hangs up before its reply (--hedge does) costs only
+    // that connection
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        if ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            err(1, "relay accept");
+        }
+        if ((errno = pthread_create(&thread, &attr, relay_client, (void *)(intptr_t)fd)) != 0) {
+            warn("pthread_create");
+            close(fd);
+        }
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *value;
+
+    if (argc > 1)
+        debug = (strtoul(argv[1], NULL, 16) & WSLP_CHILD_FLAG_DEBUG) != 0;
+
+    parse_delay(getenv("PIPE_STANDIN_DELAY"));
+    conf.hang = env_probability("PIPE_STANDIN_HANG");
+    conf.crash = env_probability("PIPE_STANDIN_CRASH");
+    conf.partial = env_probability("PIPE_STANDIN_PARTIAL");
+    conf.busy = env_probability("PIPE_STANDIN_BUSY");
+    if ((value = getenv("PIPE_STANDIN_SEED")) != NULL && *value != '\0')
+        conf.seed = strtoul(value, NULL, 0);
+    else
+        conf.seed = (unsigned long)time(NULL);
+    conf.seed ^= (unsigned long)getpid() << 16;
+
+    if ((value = getenv("PIPE_STANDIN_AGENT")) != NULL && *value != '\0')
+        conf.agent = value;
+    else if ((value = getenv("PIPE_STANDIN_KEYS")) != NULL && *value != '\0')
+        load_keys(value);
+
+    if (argc > 3 && !strcmp(argv[2], "--relay"))
+        return relay_main(argv[3]);
+    return pipe_main();
+}
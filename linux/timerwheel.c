@@ -0,0 +1,154 @@
+/*
+ * ssh-agent-wsl hierarchical timer wheel.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define WHEEL_SPAN ((int64_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+
+static void
+list_init(struct timer *head)
+{
+    head->next = head->prev = head;
+}
+
+
+static void
+list_append(struct timer *head, struct timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+
+static void
+list_unlink(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+
+void
+timer_wheel_init(struct timer_wheel *tw, int64_t now)
+{
+    int level, slot;
+
+    tw->now = now;
+    tw->count = 0;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+            list_init(&tw->slots[level][slot]);
+}
+
+
+// Link t into the slot matching its expiry, relative to the current tick.
+// Only cascade() may place a timer into the slot of the current tick, which
+// it does right before that slot is run.
+static void
+place(struct timer_wheel *tw, struct timer *t, int64_t earliest)
+{
+    int64_t delta;
+    int level;
+
+    if (t->expires < earliest)
+        t->expires = earliest;
+    delta = t->expires - tw->now;
+    if (delta >= WHEEL_SPAN)
+        t->expires = tw->now + WHEEL_SPAN - 1;
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < ((int64_t)1 << LEVEL_SHIFT(level + 1)))
+            break;
+    }
+    list_append(&tw->slots[level][(t->expires >> LEVEL_SHIFT(level)) & SLOT_MASK], t);
+}
+
+
+void
+timer_add(struct timer_wheel *tw, struct timer *t, int64_t expires)
+{
+    if (timer_pending(t))
+        list_unlink(t);
+    else
+        ++tw->count;
+    t->expires = expires;
+    place(tw, t, tw->now + 1);
+}
+
+
+void
+timer_del(struct timer_wheel *tw, struct timer *t)
+{
+    if (!timer_pending(t))
+        return;
+    list_unlink(t);
+    --tw->count;
+}
+
+
+// Re-place the timers of a higher level slot whose time span has started
+static void
+cascade(struct timer_wheel *tw, int level)
+{
+    struct timer *head = &tw->slots[level][(tw->now >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    struct timer list;
+
+    if (head->next == head)
+        return;
+    // Detach the whole slot first, placing may link timers back into it
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = list.prev->next = &list;
+    list_init(head);
+    while (list.next != &list) {
+        struct timer *t = list.next;
+        list_unlink(t);
+        place(tw, t, tw->now);
+    }
+}
+
+
+size_t
+timer_wheel_advance(struct timer_wheel *tw, int64_t now,
+                    void (*expire)(struct timer *t, void *arg), void *arg)
+{
+    size_t expired = 0;
+
+    while (tw->now < now) {
+        int level;
+
+        if (tw->count == 0) {
+            tw->now = now;  // nothing to run on the way
+            break;
+        }
+        ++tw->now;
+        // At the start of a level's span, bring its timers down a level
+        for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if (tw->now & (((int64_t)1 << LEVEL_SHIFT(level)) - 1))
+                break;
+        }
+        while (--level > 0)
+            cascade(tw, level);
+
+        struct timer *head = &tw->slots[0][tw->now & SLOT_MASK];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            list_unlink(t);
+            --tw->count;
+            ++expired;
+            expire(t, arg);
+        }
+    }
+    return expired;
+}
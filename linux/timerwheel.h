@@ -0,0 +1,56 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl hierarchical timer wheel.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+// A timer is embedded in the object it times out, which finds itself back
+// from it with container_of-style pointer arithmetic. It is pending while
+// linked into a slot.
+struct timer {
+    struct timer *next, *prev;
+    int64_t expires;  // in ticks
+};
+
+// Each level has 64 slots, and a slot of level N covers 64^N ticks: with
+// one-second ticks, the wheel reaches about three days ahead. Timers further
+// out are clamped to that. Adding, moving and removing a timer is O(1);
+// timers move down a level at most twice before they expire.
+struct timer_wheel {
+    int64_t now;
+    size_t count;
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+};
+
+void timer_wheel_init(struct timer_wheel *tw, int64_t now);
+
+// Arm (or re-arm) t to expire at the given tick. A time which has already
+// passed expires on the next advance.
+void timer_add(struct timer_wheel *tw, struct timer *t, int64_t expires);
+
+// Disarm t if it is pending.
+void timer_del(struct timer_wheel *tw, struct timer *t);
+
+static inline int
+timer_pending(const struct timer *t)
+{
+    return t->next != NULL;
+}
+
+// Move the wheel to tick now and call expire() for every timer which expired
+// on the way, after disarming it. expire() may add and delete timers.
+// Returns the number of expired timers.
+size_t timer_wheel_advance(struct timer_wheel *tw, int64_t now,
+                           void (*expire)(struct timer *t, void *arg), void *arg);
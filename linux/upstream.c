@@ -0,0 +1,425 @@
+/*
+ * ssh-agent-wsl backend forwarding to an ssh-agent on a Unix socket.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <err.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+#include "backend.h"
+
+struct upstream_conn {
+    int fd;
+    int64_t last_used;  // monotonic ms
+    int64_t sent;  // now_us() of the last request
+};
+
+// Latencies of the last hedgeable requests of a backend, in microseconds
+#define HEDGE_WINDOW 64
+#define HEDGE_MIN_SAMPLES 20
+
+struct latency_window {
+    int64_t samples[HEDGE_WINDOW];
+    int count, next;
+    int64_t p95;  // recomputed every few samples, -1 before there are enough
+};
+
+struct upstream {
+    struct backend backend;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int ok;  // shared by all threads, updated atomically
+    int slot;  // in pools
+    int (*spawn)(const char *name);  // see upstream_set_spawn()
+    int64_t spawned;  // now_ms() of the last try, updated atomically
+};
+
+#define UPSTREAM(b) ((struct upstream *)((char *)(b) - offsetof(struct upstream, backend)))
+
+// Request i of a batch goes over connection i, the agent answers each
+// connection in order but works on several connections at once.
+static __thread struct upstream_conn pools[MAX_BACKENDS][BACKEND_MAX_BATCH] = {
+    [0 ... MAX_BACKENDS - 1] = { [0 ... BACKEND_MAX_BATCH - 1] = { -1, 0, 0 } }
+};
+static __thread struct latency_window windows[MAX_BACKENDS] = {
+    [0 ... MAX_BACKENDS - 1] = { .p95 = -1 }
+};
+static int nupstreams = 0;
+static int hedging = 0;  // HEDGE_* flags
+static unsigned long hedges_sent = 0, hedges_won = 0;  // updated atomically
+
+// Do not try to start what should be listening more often than this
+#define SPAWN_INTERVAL_MS 5000
+
+
+static int64_t
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int64_t
+now_ms()
+{
+    return now_us() / 1000;
+}
+
+
+static void
+conn_close(struct upstream_conn *c)
+{
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+
+// Whether nothing listens on the socket but was started now, in this thread:
+// the other threads fail their requests meanwhile rather than start it again.
+static int
+spawned(struct upstream *u)
+{
+    int64_t now = now_ms(), last = __atomic_load_n(&u->spawned, __ATOMIC_RELAXED);
+    int saved_errno = errno, ok;
+
+    if (!u->spawn || (errno != ECONNREFUSED && errno != ENOENT) || now - last < SPAWN_INTERVAL_MS ||
+        !__atomic_compare_exchange_n(&u->spawned, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+    ok = u->spawn(u->backend.name) == 0;
+    errno = saved_errno;  // for the warning if it did not work
+    return ok;
+}
+
+
+static int
+conn_open(struct upstream *u, struct upstream_conn *c)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        warn("upstream socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&u->addr, u->addrlen) < 0 &&
+        (!spawned(u) || connect(fd, (struct sockaddr *)&u->addr, u->addrlen) < 0)) {
+        // Only complain when it goes away, not for every request while it is
+        if (__atomic_exchange_n(&u->ok, 0, __ATOMIC_RELAXED))
+            warn("connect to upstream agent %s", u->backend.name);
+        close(fd);
+        return -1;
+    }
+    if (!__atomic_exchange_n(&u->ok, 1, __ATOMIC_RELAXED))
+        warnx("upstream agent %s is reachable again", u->backend.name);
+    c->fd = fd;
+    c->last_used = now_ms();
+    return 0;
+}
+
+
+// An idle connection has nothing to read unless the agent closed it (because
+// it was restarted, say), or sent something it should not have.
+static int
+conn_stale(const struct upstream_conn *c)
+{
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) != 0;
+}
+
+
+static int
+send_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t cnt;
+
+    while (len > 0) {
+        cnt = send(fd, buf, len, MSG_NOSIGNAL);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt < 0)
+            return -1;
+        buf += cnt;
+        len -= (size_t)cnt;
+    }
+    return 0;
+}
+
+
+static int
+upstream_submit(struct backend *b, uint8_t *const *bufs, int n)
+{
+    struct upstream *u = UPSTREAM(b);
+    struct upstream_conn *pool = pools[u->slot];
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        struct upstream_conn *c = &pool[i];
+        int reused = c->fd >= 0;
+
+        if (reused && conn_stale(c)) {
+            conn_close(c);
+            reused = 0;
+        }
+        if (c->fd < 0 && conn_open(u, c) != 0)
+            goto fail;
+        c->sent = now_us();
+        if (send_all(c->fd, bufs[i], msglen(bufs[i])) == 0)
+            continue;
+
+        // The agent may have closed a pooled connection just now, it has
+        // seen nothing of the request then: try once more on a new one
+        conn_close(c);
+        if (!reused || conn_open(u, c) != 0 || send_all(c->fd, bufs[i], msglen(bufs[i])) != 0) {
+            warn("send to upstream agent %s", b->name);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    // Replies to the requests sent already must not be taken for the
+    // replies to later ones
+    while (i >= 0)
+        conn_close(&pool[i--]);
+    return -1;
+}
+
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void
+record_latency(struct latency_window *w, int64_t us)
+{
+    int64_t sorted[HEDGE_WINDOW];
+
+    w->samples[w->next] = us;
+    w->next = (w->next + 1) % HEDGE_WINDOW;
+    if (w->count < HEDGE_WINDOW)
+        ++w->count;
+    if (w->count >= HEDGE_MIN_SAMPLES && w->next % 8 == 0) {
+        memcpy(sorted, w->samples, (size_t)w->count * sizeof(*sorted));
+        qsort(sorted, (size_t)w->count, sizeof(*sorted), cmp_int64);
+        w->p95 = sorted[w->count * 95 / 100];
+    }
+}
+
+
+// Listing and the query extension change nothing, so a second copy does no
+// harm. Signing twice only costs time, and is hedged on request.
+static int
+hedgeable(const uint8_t *msg)
+{
+    static const uint8_t query[9] = { 0, 0, 0, 5, 'q', 'u', 'e', 'r', 'y' };
+
+    switch (msg[4]) {
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+        return hedging != 0;
+    case SSH_AGENTC_EXTENSION:
+        return hedging && msglen(msg) >= 5 + sizeof(query) && !memcmp(msg + 5, query, sizeof(query));
+    case SSH_AGENTC_SIGN_REQUEST:
+        return (hedging & HEDGE_SIGN) != 0;
+    default:
+        return 0;
+    }
+}
+
+
+// Wait until the reply to the request in buf starts to arrive on pool[0]. If
+// it takes longer than 95% of the recent ones, send the request again over
+// pool[1]: the connection which answers first ends up in pool[0], the other
+// one is closed, so that its reply is not taken for a later request's.
+static void
+hedge(struct upstream *u, struct upstream_conn *pool, const uint8_t *buf)
+{
+    struct latency_window *w = &windows[u->slot];
+    struct pollfd pfd[2] = { { pool[0].fd, POLLIN, 0 }, { -1, POLLIN, 0 } };
+    int64_t wait_us = w->p95 - (now_us() - pool[0].sent);
+    struct upstream_conn winner;
+    int ready;
+
+    if (w->p95 < 0 || poll(pfd, 1, wait_us > 0 ? (int)((wait_us + 999) / 1000) : 0) != 0)
+        return;
+
+    if (pool[1].fd >= 0 && conn_stale(&pool[1]))
+        conn_close(&pool[1]);
+    if ((pool[1].fd < 0 && conn_open(u, &pool[1]) != 0) || send_all(pool[1].fd, buf, msglen(buf)) != 0) {
+        conn_close(&pool[1]);
+        return;
+    }
+    __atomic_add_fetch(&hedges_sent, 1, __ATOMIC_RELAXED);
+    pfd[1].fd = pool[1].fd;
+    while ((ready = poll(pfd, 2, -1)) < 0 && errno == EINTR)
+        ;
+    if (ready > 0 && pfd[1].revents && !pfd[0].revents) {
+        __atomic_add_fetch(&hedges_won, 1, __ATOMIC_RELAXED);
+        winner = pool[1];
+        pool[1] = pool[0];
+        pool[0] = winner;
+        pool[0].sent = pool[1].sent;
+    }
+    conn_close(&pool[1]);
+}
+
+
+static int
+upstream_complete(struct backend *b, uint8_t *const *bufs, int n)
+{
+    struct upstream *u = UPSTREAM(b);
+    struct upstream_conn *pool = pools[u->slot];
+    int hedged = n == 1 && hedgeable(bufs[0]);
+    int64_t now;
+    ssize_t cnt;
+    int i;
+
+    // Only single requests, in a batch the others wait for this one anyway
+    if (hedged)
+        hedge(u, pool, bufs[0]);
+
+    for (i = 0; i < n; ++i) {
+        struct upstream_conn *c = &pool[i];
+        uint8_t *buf = bufs[i];
+        size_t got = 0;
+        int64_t size;
+
+        while ((size = frame_check(buf, got, AGENT_MAX_MSGLEN)) <= 0) {
+            if (size == FRAME_TOO_LONG) {
+                warnx("upstream agent %s tried to return %u bytes", b->name, msglen(buf) - 4);
+                goto fail;
+            }
+            cnt = recv(c->fd, buf + got, AGENT_MAX_MSGLEN - got, 0);
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            if (cnt < 0) {
+                warn("recv from upstream agent %s", b->name);
+                goto fail;
+            }
+            if (cnt == 0) {
+                warnx("upstream agent %s closed the connection during a query", b->name);
+                goto fail;
+            }
+            got += (size_t)cnt;
+        }
+        if (got != (size_t)size) {
+            warnx("upstream agent %s returned %zu bytes after the reply", b->name, got - (size_t)size);
+            goto fail;
+        }
+    }
+
+    now = now_us();
+    for (i = 0; i < n; ++i)
+        pool[i].last_used = now / 1000;
+    if (hedged)
+        record_latency(&windows[u->slot], now - pool[0].sent);
+    return 0;
+
+fail:
+    for (i = 0; i < n; ++i)
+        conn_close(&pool[i]);
+    return -1;
+}
+
+
+static void
+upstream_start(struct backend *b)
+{
+    struct upstream *u = UPSTREAM(b);
+
+    if (pools[u->slot][0].fd < 0)
+        conn_open(u, &pools[u->slot][0]);
+}
+
+
+static void
+upstream_release_idle(struct backend *b, int64_t idle_ms)
+{
+    struct upstream_conn *pool = pools[UPSTREAM(b)->slot];
+    int64_t now = now_ms();
+    int i;
+
+    for (i = 0; i < BACKEND_MAX_BATCH; ++i) {
+        if (pool[i].fd >= 0 && now - pool[i].last_used >= idle_ms)
+            conn_close(&pool[i]);
+    }
+}
+
+
+static int
+upstream_healthy(struct backend *b)
+{
+    return __atomic_load_n(&UPSTREAM(b)->ok, __ATOMIC_RELAXED);
+}
+
+
+struct backend *
+upstream_new(const char *name, const struct sockaddr_un *addr, socklen_t len)
+{
+    static const struct backend ops = {
+        NULL,
+        upstream_submit,
+        upstream_complete,
+        upstream_start,
+        upstream_release_idle,
+        upstream_healthy,
+    };
+    struct upstream *u;
+
+    if (nupstreams == MAX_BACKENDS) {
+        warnx("too many upstream agents, at most %d are supported", MAX_BACKENDS);
+        return NULL;
+    }
+    if ((u = calloc(1, sizeof(*u))) == NULL) {
+        warnx("upstream_new: No memory");
+        return NULL;
+    }
+    u->backend = ops;
+    u->backend.name = name;
+    memcpy(&u->addr, addr, len);
+    u->addrlen = len;
+    u->ok = 1;
+    u->slot = nupstreams++;
+    u->spawned = now_ms() - SPAWN_INTERVAL_MS;
+    return &u->backend;
+}
+
+
+void
+upstream_set_hedging(int mode)
+{
+    hedging = mode;
+}
+
+
+void
+upstream_hedge_stats(unsigned long *sent, unsigned long *won)
+{
+    *sent = __atomic_load_n(&hedges_sent, __ATOMIC_RELAXED);
+    *won = __atomic_load_n(&hedges_won, __ATOMIC_RELAXED);
+}
+
+
+void
+upstream_set_spawn(struct backend *b, int (*spawn)(const char *name))
+{
+    UPSTREAM(b)->spawn = spawn;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl minimal io_uring wrapper.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Just enough of liburing to batch reads and writes, without depending on
+// it: a ring is set up with io_uring_setup() and its queues are mapped and
+// driven by hand.
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_pending;  // filled in but not submitted yet
+};
+
+// Returns 0, or -1 with errno set if the kernel has no io_uring (WSL 1,
+// older kernels, seccomp filters).
+int uring_init(struct uring *ring, unsigned entries);
+void uring_free(struct uring *ring);
+
+// Next free submission entry, cleared, or NULL if the queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, uint64_t user_data);
+
+// Submit the pending entries and wait for at least wait_nr completions.
+// Returns the number submitted, or -1 with errno set.
+int uring_submit_wait(struct uring *ring, unsigned wait_nr);
+
+// Oldest completion not seen yet, or NULL.
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
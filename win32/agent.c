@@ -20,12 +20,24 @@
 
 #include "../common.h"
 #include "agent.h"
+#include "aimd.h"
 
 #define AGENT_PIPE_ID L"\\\\.\\pipe\\openssh-ssh-agent"
-#define SSH_AGENT_FAILURE ERROR_ACCESS_DENIED
+
+// Connections open to the agent at once, see aimd.h. With --relay several
+// threads query it, otherwise there is only ever one.
+#define AGENT_MAX_CONNECTIONS 8
+
+// Give up on an agent whose pipes stay busy for this long
+#define AGENT_BUSY_TIMEOUT_MS 1000
 
 uint32_t flags = 0;
 
+static SRWLOCK limit_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE limit_changed = CONDITION_VARIABLE_INIT;
+static struct aimd limit;
+static int limit_ready = 0;
+
 // Rupor: printing debug output does not always work, probably due to buffering and WSL/WIN32 interoperability, so
 // we'll use proper OutputDebugString here
 void print_debug(const char *fmt, ...)
@@ -74,6 +86,72 @@ static PSID get_user_sid(void)
     return ret;
 }
 
+static double now_ms(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1000 / (double)freq.QuadPart;
+}
+
+
+// Take a place in the queue for connections to the agent
+static uint32_t limit_enqueue(void)
+{
+    uint32_t ticket;
+
+    AcquireSRWLockExclusive(&limit_lock);
+    if (!limit_ready) {
+        aimd_init(&limit, AGENT_MAX_CONNECTIONS / 2, AGENT_MAX_CONNECTIONS);
+        limit_ready = 1;
+    }
+    ticket = aimd_enqueue(&limit);
+    ReleaseSRWLockExclusive(&limit_lock);
+    return ticket;
+}
+
+
+// Wait for the turn of ticket to connect to the agent. After busy pipes, the
+// backoff is waited out first, so that it does not hold a connection.
+static void limit_acquire(uint32_t ticket)
+{
+    int backoff;
+
+    AcquireSRWLockExclusive(&limit_lock);
+    while (!aimd_turn(&limit, ticket))
+        SleepConditionVariableSRW(&limit_changed, &limit_lock, INFINITE, 0);
+    if ((backoff = aimd_backoff_ms(&limit)) > 0) {
+        ReleaseSRWLockExclusive(&limit_lock);
+        print_debug("agent pipe busy, waiting %d ms", backoff);
+        Sleep(backoff);
+        AcquireSRWLockExclusive(&limit_lock);
+    }
+    while (!aimd_start(&limit, ticket))
+        SleepConditionVariableSRW(&limit_changed, &limit_lock, INFINITE, 0);
+    // The next one in line may be let in as well
+    WakeAllConditionVariable(&limit_changed);
+    ReleaseSRWLockExclusive(&limit_lock);
+}
+
+
+// End a connection started by limit_acquire(). With retry, the request tries
+// again with the same ticket.
+static void limit_release(int outcome, double started_ms, int retry)
+{
+    double now = now_ms();
+
+    AcquireSRWLockExclusive(&limit_lock);
+    aimd_done(&limit, outcome, now - started_ms, (int64_t)now);
+    if (retry)
+        aimd_retry(&limit);
+    WakeAllConditionVariable(&limit_changed);
+    ReleaseSRWLockExclusive(&limit_lock);
+}
+
+
 void agent_query(void* buf)
 {
     static const char reply_error[5] = {0, 0, 0, 1, SSH_AGENT_FAILURE};
@@ -93,9 +171,15 @@ void agent_query(void* buf)
         }
     }
 
+    // Rather than wait in WaitNamedPipe() when all pipe instances are busy,
+    // which takes a fixed time, queue for a turn: the limit on connections
+    // open at once adapts to how busy the agent is.
     HANDLE hPipe;
+    double started, busy_since = -1;
+    uint32_t ticket = limit_enqueue();
     while (1) {
-
+        limit_acquire(ticket);
+        started = now_ms();
         hPipe = CreateFile(AGENT_PIPE_ID, GENERIC_READ | GENERIC_WRITE, 0, psa, OPEN_EXISTING, 0, NULL);
 
         // Break if we have it
@@ -104,17 +188,23 @@ void agent_query(void* buf)
         }
 
         // Exit if an error other than ERROR_PIPE_BUSY occurs.
-        if (GetLastError() != ERROR_PIPE_BUSY) {
-            print_debug("Can't open pipe: %d", GetLastError());
+        DWORD error_code = GetLastError();
+        if (error_code != ERROR_PIPE_BUSY) {
+            limit_release(AIMD_ERROR, started, 0);
+            print_debug("Can't open pipe: %d", error_code);
             memcpy(buf, reply_error, msglen(reply_error));
             return;
         }
 
-        // All pipe instances are busy, so wait for 1 second.
-        if (!WaitNamedPipe(AGENT_PIPE_ID, 1000)) {
+        if (busy_since < 0)
+            busy_since = started;
+        else if (started - busy_since >= AGENT_BUSY_TIMEOUT_MS) {
+            limit_release(AIMD_BUSY, started, 0);
+            print_debug("Pipe still busy after %d ms", AGENT_BUSY_TIMEOUT_MS);
             memcpy(buf, reply_error, msglen(reply_error));
             return;
         }
+        limit_release(AIMD_BUSY, started, 1);
     }
 
     print_debug("agent_query connected to the pipe");
@@ -123,24 +213,36 @@ void agent_query(void* buf)
     if (!WriteFile(hPipe, buf, msglen(buf), &cbWritten, NULL)) {
         print_debug("Can't write to pipe: %d", GetLastError());
         memcpy(buf, reply_error, msglen(reply_error));
+        CloseHandle(hPipe);
+        limit_release(AIMD_ERROR, started, 0);
         return;
     }
 
-    DWORD cbRead;
-    BOOL  fSuccess = FALSE;
-    do {
-        fSuccess = ReadFile(hPipe, buf, AGENT_MAX_MSGLEN, &cbRead, NULL);
+    // The reply may come in pieces (ERROR_MORE_DATA on a message pipe, or
+    // short reads on a byte pipe), read until the frame is complete
+    DWORD cbRead, cbGot = 0;
+    BOOL  fSuccess = TRUE;
+    int64_t size;
+    while ((size = frame_check(buf, cbGot, AGENT_MAX_MSGLEN)) == FRAME_PARTIAL) {
+        fSuccess = ReadFile(hPipe, (uint8_t *)buf + cbGot, AGENT_MAX_MSGLEN - cbGot, &cbRead, NULL);
         if (!fSuccess && GetLastError() != ERROR_MORE_DATA)
             break;
-    } while (!fSuccess);
+        if (fSuccess && cbRead == 0)
+            break;  // EOF
+        cbGot += cbRead;
+    }
 
-    if (!fSuccess) {
-        print_debug("Can't read from pipe: %d", GetLastError());
+    // A reply which is cut short or runs on can't be passed on
+    if (size != cbGot) {
+        print_debug("Can't read from pipe: %d (%d bytes)", fSuccess ? 0 : GetLastError(), cbGot);
         memcpy(buf, reply_error, msglen(reply_error));
+        CloseHandle(hPipe);
+        limit_release(AIMD_ERROR, started, 0);
         return;
     }
 
     CloseHandle(hPipe);
+    limit_release(AIMD_OK, started, 0);
     print_debug("agent_query done");
 }
 
@@ -0,0 +1,108 @@
+/*
+ * ssh-agent-wsl adaptive limit on connections to the Windows agent.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+#include "aimd.h"
+
+// The usual latency follows a slower reply by this fraction of the difference,
+// and a faster one at once
+#define USUAL_GAIN (1.0 / 16)
+
+void aimd_init(struct aimd *a, int initial, int max)
+{
+    a->limit = initial;
+    a->max = max;
+    a->inflight = 0;
+    a->next_ticket = 0;
+    a->head = 0;
+    a->retrying = 0;
+    a->usual_ms = -1;
+    a->last_decrease_ms = INT64_MIN / 2;
+    a->backoff_ms = 0;
+}
+
+
+uint32_t aimd_enqueue(struct aimd *a)
+{
+    return a->next_ticket++;
+}
+
+
+// Whether ticket had its turn already, and so is trying again
+static int retried(const struct aimd *a, uint32_t ticket)
+{
+    return (int32_t)(ticket - a->head) < 0;
+}
+
+
+int aimd_turn(const struct aimd *a, uint32_t ticket)
+{
+    return retried(a, ticket) || (ticket == a->head && a->retrying == 0);
+}
+
+
+int aimd_start(struct aimd *a, uint32_t ticket)
+{
+    if (!aimd_turn(a, ticket) || a->inflight >= (int)a->limit)
+        return 0;
+    if (retried(a, ticket))
+        --a->retrying;
+    else
+        ++a->head;
+    ++a->inflight;
+    return 1;
+}
+
+
+int aimd_backoff_ms(const struct aimd *a)
+{
+    return a->backoff_ms;
+}
+
+
+void aimd_done(struct aimd *a, int outcome, double latency_ms, int64_t now_ms)
+{
+    int slow = 0;
+
+    --a->inflight;
+    if (outcome == AIMD_OK) {
+        if (a->usual_ms < 0 || latency_ms < a->usual_ms)
+            a->usual_ms = latency_ms;
+        else {
+            slow = latency_ms > 2 * a->usual_ms;
+            a->usual_ms += (latency_ms - a->usual_ms) * USUAL_GAIN;
+        }
+    }
+
+    if (outcome == AIMD_OK && !slow) {
+        a->limit += 1 / a->limit;
+        if (a->limit > a->max)
+            a->limit = a->max;
+        a->backoff_ms = 0;
+        return;
+    }
+
+    // The connections in flight meanwhile saw the same congestion
+    if (now_ms - a->last_decrease_ms >= (a->usual_ms > 1 ? a->usual_ms : 1)) {
+        a->limit /= 2;
+        if (a->limit < 1)
+            a->limit = 1;
+        a->last_decrease_ms = now_ms;
+    }
+    if (outcome == AIMD_BUSY) {
+        a->backoff_ms = a->backoff_ms ? 2 * a->backoff_ms : 10;
+        if (a->backoff_ms > AIMD_MAX_BACKOFF_MS)
+            a->backoff_ms = AIMD_MAX_BACKOFF_MS;
+    }
+}
+
+
+void aimd_retry(struct aimd *a)
+{
+    ++a->retrying;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+ * ssh-agent-wsl adaptive limit on connections to the Windows agent.
+ *
+ * This file is part of ssh-agent-wsl, and is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ */
+
+// This file has no Windows dependencies, the caller brings the locking and
+// the clock.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// How a connection went, for aimd_done()
+#define AIMD_OK 0  // the request was answered
+#define AIMD_BUSY 1  // all pipe instances were busy
+#define AIMD_ERROR 2  // it failed otherwise
+
+#define AIMD_MAX_BACKOFF_MS 500
+
+// Additive increase, multiplicative decrease of the number of connections
+// open to the agent at once, as TCP does with its window: replies about as
+// fast as usual let the limit grow by one every limit replies, while busy
+// pipes, errors and replies which take twice as long as usual halve it (once
+// per round trip, however many connections saw it). Requests beyond the limit
+// wait their turn in order of arrival, and one which found the pipes busy
+// tries again ahead of those which have not had a turn yet.
+struct aimd {
+    double limit;
+    int max;
+    int inflight;
+    uint32_t next_ticket;  // given to the next request
+    uint32_t head;  // of the request whose turn it is
+    int retrying;  // requests which had their turn and wait to try again
+    double usual_ms;  // latency of a reply, tracking the fast ones; < 0 before the first
+    int64_t last_decrease_ms;
+    int backoff_ms;  // before connecting again after busy pipes, 0 if they were not
+};
+
+void aimd_init(struct aimd *a, int initial, int max);
+
+// Take a place in the queue
+uint32_t aimd_enqueue(struct aimd *a);
+
+// Whether it is the turn of the request holding ticket. It should then wait
+// aimd_backoff_ms() before aimd_start(), without holding a connection.
+int aimd_turn(const struct aimd *a, uint32_t ticket);
+
+// Whether the request holding ticket may connect now. Then it is in flight
+// until aimd_done().
+int aimd_start(struct aimd *a, uint32_t ticket);
+
+int aimd_backoff_ms(const struct aimd *a);
+
+// A connection in flight is over, with latency_ms from connecting to the
+// reply for AIMD_OK.
+void aimd_done(struct aimd *a, int outcome, double latency_ms, int64_t now_ms);
+
+// The request whose connection just ended with AIMD_BUSY tries again with the
+// same ticket.
+void aimd_retry(struct aimd *a);
+
+#ifdef __cplusplus
+}
+#endif
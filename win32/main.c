@@ -13,8 +13,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <winsock2.h>
 #include <windows.h>
+#include <afunix.h>
+#include <aclapi.h>
 
 #include "agent.h"
 #include "../common.h"
@@ -31,18 +36,52 @@ void print_error(const char *fmt, ...)
     fprintf(stderr, "\n");
 }
 
+// Input from the linux side, which may send several requests at once.
+// ReadFile() returns what is in the pipe, up to the space left, and packets
+// are taken from the buffer.
+static struct {
+    uint8_t buf[2 * AGENT_MAX_MSGLEN];
+    struct frame_reader frames;
+} in;
+
+// Replies are collected here and written out together once no more requests
+// are waiting.
+static struct {
+    uint8_t buf[2 * AGENT_MAX_MSGLEN];
+    DWORD len;
+} out;
+
+
+// Whether a whole packet is in the input buffer
+static int packet_buffered(void)
+{
+    struct frame_reader peek = in.frames;
+    return frame_next(&peek, in.buf, AGENT_MAX_MSGLEN) > 0;
+}
+
+
 static DWORD read_packet(const HANDLE input, uint8_t *buf)
 {
-    DWORD cnt, rem = 4, got_length = 0;
+    DWORD cnt, avail;
     DWORD error_code = ERROR_SUCCESS;
-    uint8_t *bufp = buf;
-
-    // Documentation indicates that ReadFile() returns when a "write operation completes
-    // on the write end of the pipe". Since the linux side may call write() multiple times,
-    // loop until everything has been read.
-    while (rem > 0) {
-        print_debug("start read with rem=%d", rem);
-        if (!ReadFile(input, bufp, rem, &cnt, NULL)) {
+    int64_t size;
+
+    while ((size = frame_next(&in.frames, in.buf, AGENT_MAX_MSGLEN)) <= 0) {
+        avail = (DWORD)(in.frames.end - in.frames.start);
+        if (size == FRAME_TOO_LONG) {
+            print_error("got packet with length %d exceeding maximum", msglen(in.buf + in.frames.start) - 4);
+            return 0;
+        }
+
+        // Make room for the rest of the packet
+        if (in.frames.start > 0) {
+            memmove(in.buf, in.buf + in.frames.start, avail);
+            in.frames.start = 0;
+            in.frames.end = avail;
+        }
+
+        print_debug("start read with %d bytes buffered", avail);
+        if (!ReadFile(input, in.buf + in.frames.end, (DWORD)(sizeof(in.buf) - in.frames.end), &cnt, NULL)) {
             error_code = GetLastError();
 
             if (error_code != ERROR_BROKEN_PIPE)  // EOF
@@ -58,34 +97,27 @@ static DWORD read_packet(const HANDLE input, uint8_t *buf)
             return 0;
         }
 
-        bufp += cnt;
-        rem -= cnt;
-
-        if (rem > 0)
-            continue;  // more to read
-
-        if (!got_length) {
-            rem = msglen(buf) - 4;
-            if (rem > (AGENT_MAX_MSGLEN - 4)) {
-                print_error("got packet with length %d exceeding maximum", rem);
-                return 0;
-            }
-            print_debug("input packet length is 4+%d", rem);
-            got_length = 1;
-        }
+        in.frames.end += cnt;
     }
 
+    // frame_next() has moved past it already
+    print_debug("input packet length is 4+%d", (int)size - 4);
+    memcpy(buf, in.buf + in.frames.start - (size_t)size, (size_t)size);
     return 1;
 }
 
 
-static DWORD write_packet(const HANDLE output, uint8_t *buf)
+static DWORD flush_packets(const HANDLE output)
 {
-    DWORD rem = msglen(buf), cnt;
+    DWORD rem = out.len, cnt;
     DWORD error_code;
 
+    out.len = 0;
+    if (rem == 0)
+        return 1;
+
     // Assume that WriteFile will write everything given to it
-    if (!WriteFile(output, buf, rem, &cnt, NULL)) {
+    if (!WriteFile(output, out.buf, rem, &cnt, NULL)) {
         error_code = GetLastError();
 
         if (error_code != ERROR_BROKEN_PIPE)  // linux side is gone
@@ -94,7 +126,7 @@ static DWORD write_packet(const HANDLE output, uint8_t *buf)
     }
 
     if (cnt != rem) {
-        print_error("short write: wanted to write %d byte packet, wrote %d bytes", rem, cnt);
+        print_error("short write: wanted to write %d bytes of packets, wrote %d bytes", rem, cnt);
         return 0;
     }
 
@@ -102,6 +134,20 @@ static DWORD write_packet(const HANDLE output, uint8_t *buf)
 }
 
 
+static DWORD write_packet(const HANDLE output, uint8_t *buf)
+{
+    if (out.len + msglen(buf) > sizeof(out.buf) && !flush_packets(output))
+        return 0;
+    memcpy(out.buf + out.len, buf, msglen(buf));
+    out.len += msglen(buf);
+
+    // The linux side waits for these before sending more
+    if (!packet_buffered())
+        return flush_packets(output);
+    return 1;
+}
+
+
 static void main_loop(const HANDLE output, const HANDLE input)
 {
     uint8_t buf[AGENT_MAX_MSGLEN];
@@ -126,6 +172,216 @@ static void main_loop(const HANDLE output, const HANDLE input)
 }
 
 
+// Serve one connection of a daemon: requests are answered one by one, and the
+// connection is kept for the next one until the daemon closes it.
+static DWORD WINAPI relay_client(LPVOID param)
+{
+    const SOCKET s = (SOCKET)(UINT_PTR)param;
+    uint8_t *buf = malloc(AGENT_MAX_MSGLEN);
+    int cnt, got, sent;
+    int64_t size;
+
+    while (buf) {
+        got = 0;
+        while ((size = frame_check(buf, got, AGENT_MAX_MSGLEN)) <= 0) {
+            if (size == FRAME_TOO_LONG) {
+                print_error("got packet with length %d exceeding maximum", msglen(buf) - 4);
+                goto done;
+            }
+            if ((cnt = recv(s, (char *)buf + got, AGENT_MAX_MSGLEN - got, 0)) <= 0) {
+                if (cnt < 0)
+                    print_debug("relay recv failed with code %d", WSAGetLastError());
+                goto done;
+            }
+            got += cnt;
+        }
+        if (got != size) {
+            print_error("relay got %d bytes after a request", got - (int)size);
+            goto done;
+        }
+
+        agent_query(buf);
+
+        for (sent = 0; sent < (int)msglen(buf); sent += cnt) {
+            if ((cnt = send(s, (const char *)buf + sent, (int)msglen(buf) - sent, 0)) < 0) {
+                print_debug("relay send failed with code %d", WSAGetLastError());
+                goto done;
+            }
+        }
+    }
+
+done:
+    free(buf);
+    closesocket(s);
+    return 0;
+}
+
+
+// The SID of the user running the relay, in sid (SECURITY_MAX_SID_SIZE bytes)
+static int relay_user(PSID sid)
+{
+    union {
+        TOKEN_USER user;
+        uint8_t buf[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    } info;
+    HANDLE token;
+    DWORD len;
+    BOOL ok;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+        return 0;
+    ok = GetTokenInformation(token, TokenUser, &info, sizeof(info), &len) &&
+         CopySid(SECURITY_MAX_SID_SIZE, sid, info.user.User.Sid);
+    CloseHandle(token);
+    return ok;
+}
+
+
+// The socket file itself, not what it stands for
+static HANDLE relay_open(const char *name, DWORD access)
+{
+    return CreateFileA(name, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                       OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+}
+
+
+// Whether the socket file name belongs to the user
+static int relay_owned(const char *name, PSID user)
+{
+    PSECURITY_DESCRIPTOR sd;
+    PSID owner;
+    HANDLE file = relay_open(name, READ_CONTROL);
+    int owned = 0;
+
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    if (GetSecurityInfo(file, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION,
+                        &owner, NULL, NULL, NULL, &sd) == ERROR_SUCCESS) {
+        owned = EqualSid(owner, user);
+        LocalFree(sd);
+    }
+    CloseHandle(file);
+    return owned;
+}
+
+
+// Only the user may connect to the relay, which signs with their keys: the
+// socket file gets a DACL of its own, not inherited from the directory, which
+// allows the user and nobody else. It is set before listen(), so nobody can
+// connect in between.
+static DWORD relay_restrict(const char *name, PSID user)
+{
+    EXPLICIT_ACCESSA access;
+    PACL acl = NULL;
+    HANDLE file;
+    DWORD error;
+
+    memset(&access, 0, sizeof(access));
+    access.grfAccessPermissions = GENERIC_ALL;
+    access.grfAccessMode = SET_ACCESS;
+    access.grfInheritance = NO_INHERITANCE;
+    access.Trustee.TrusteeForm = TRUSTEE_IS_SID;
+    access.Trustee.TrusteeType = TRUSTEE_IS_USER;
+    access.Trustee.ptstrName = (LPSTR)user;
+    if ((error = SetEntriesInAclA(1, &access, NULL, &acl)) != ERROR_SUCCESS)
+        return error;
+    if ((file = relay_open(name, WRITE_DAC)) == INVALID_HANDLE_VALUE)
+        error = GetLastError();
+    else {
+        error = SetSecurityInfo(file, SE_FILE_OBJECT,
+                                DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                                NULL, NULL, acl, NULL);
+        CloseHandle(file);
+    }
+    LocalFree(acl);
+    return error;
+}
+
+
+// With --relay NAME, listen on the AF_UNIX socket file NAME (Windows 10 1803
+// and newer) in the current directory instead of serving stdin/stdout. One
+// relay serves every daemon of the user, which connect to it from WSL.
+static int relay_main(const char *name)
+{
+    union {
+        SID sid;
+        uint8_t buf[SECURITY_MAX_SID_SIZE];
+    } user;
+    struct sockaddr_un addr;
+    WSADATA wsa_data;
+    SOCKET listener, s;
+    HANDLE thread;
+    int error_code;
+
+    if (!relay_user(&user.sid)) {
+        print_error("cannot get the user of the relay (code %d)", GetLastError());
+        return 1;
+    }
+    if ((error_code = WSAStartup(MAKEWORD(2, 2), &wsa_data)) != 0) {
+        print_error("WSAStartup failed with code %d", error_code);
+        return 1;
+    }
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        print_error("relay socket name %s is too long", name);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, name);
+
+    // Another daemon may have started a relay just now, leave it to that one
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        print_error("socket failed with code %d", WSAGetLastError());
+        return 1;
+    }
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        closesocket(s);
+        if (!relay_owned(name, &user.sid)) {
+            print_error("relay socket %s belongs to another user", name);
+            return 1;
+        }
+        print_debug("relay already listening on %s", name);
+        return 0;
+    }
+    closesocket(s);
+
+    // A socket file left behind by a relay which is gone
+    DeleteFileA(name);
+
+    if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        print_error("cannot listen on relay socket %s (code %d)", name, WSAGetLastError());
+        return 1;
+    }
+    if ((error_code = (int)relay_restrict(name, &user.sid)) != ERROR_SUCCESS) {
+        print_error("cannot restrict access to relay socket %s (code %d)", name, error_code);
+        closesocket(listener);
+        DeleteFileA(name);
+        return 1;
+    }
+    if (listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+        print_error("cannot listen on relay socket %s (code %d)", name, WSAGetLastError());
+        closesocket(listener);
+        DeleteFileA(name);
+        return 1;
+    }
+    print_debug("relay listening on %s", name);
+
+    while ((s = accept(listener, NULL, NULL)) != INVALID_SOCKET) {
+        thread = CreateThread(NULL, 0, relay_client, (LPVOID)(UINT_PTR)s, 0, NULL);
+        if (thread == NULL) {
+            print_error("CreateThread failed with code %d", GetLastError());
+            closesocket(s);
+        }
+        else
+            CloseHandle(thread);
+    }
+
+    print_error("relay accept failed with code %d", WSAGetLastError());
+    return 1;
+}
+
+
 int main(const int argc, const char **argv)
 {
     LPCWSTR test_error = L"This program is part of ssh-agent-wsl and cannot be executed directly.";
@@ -144,6 +400,9 @@ int main(const int argc, const char **argv)
         print_debug("flags: %08x", flags);
     }
 
+    if (argc > 3 && !strcmp(argv[2], "--relay"))
+        return relay_main(argv[3]);
+
     // RUPOR: this test is weak, it works when this is started from Windows, but  if started from WSL the result is always wrong
 
     // If this succeeds, STD_OUTPUT_HANDLE is attached to a console, meaning that this program